@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+
+// Room kept past CAPTURE_BUFFER for the truncation marker
+#define MARKER_MAX 64
+
+int capture_enabled;
+
+static int fd = -1;
+static char *buffer;
+static size_t length;
+static uint64_t room;
+static int limited;
+static int truncated;
+static uint64_t max_bytes;
+
+int capture_open(const char *path, uint64_t max)
+{
+  if (!strcmp(path, "-"))
+  {
+    fd = STDOUT_FILENO;
+  }
+  else
+  {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      return 0;
+    }
+  }
+  buffer = mmap(NULL, CAPTURE_BUFFER + MARKER_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+  {
+    buffer = NULL;
+    if (fd != STDOUT_FILENO)
+    {
+      close(fd);
+    }
+    fd = -1;
+    return 0;
+  }
+  max_bytes = max;
+  room = max;
+  limited = max != 0;
+  capture_enabled = 1;
+  return 1;
+}
+
+void capture_flush()
+{
+  size_t done = 0;
+  while (done < length)
+  {
+    ssize_t n = write(fd, buffer + done, length - done);
+    if (n <= 0)
+    {
+      break;
+    }
+    done += (size_t)n;
+  }
+  length = 0;
+}
+
+void capture_putc(char c)
+{
+  if (limited && room == 0)
+  {
+    if (!truncated)
+    {
+      truncated = 1;
+      length += (size_t)snprintf(buffer + length, MARKER_MAX, "\n[output truncated at %llu bytes]\n",
+                                 (unsigned long long)max_bytes);
+    }
+    return;
+  }
+  --room;
+  if (length == CAPTURE_BUFFER)
+  {
+    capture_flush();
+  }
+  buffer[length++] = c;
+}
+
+void capture_write(const char *data, size_t n)
+{
+  if (limited && n > room)
+  {
+    // Take what fits, capture_putc() then adds the marker
+    capture_write(data, (size_t)room);
+    capture_putc(data[room]);
+    return;
+  }
+  room -= limited ? n : 0;
+  while (n)
+  {
+    if (length == CAPTURE_BUFFER)
+    {
+      capture_flush();
+    }
+    size_t chunk = CAPTURE_BUFFER - length < n ? CAPTURE_BUFFER - length : n;
+    memcpy(buffer + length, data, chunk);
+    length += chunk;
+    data += chunk;
+    n -= chunk;
+  }
+}
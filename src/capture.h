@@ -0,0 +1,25 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes collected before they are written out in one go
+#define CAPTURE_BUFFER (1 << 20)
+
+// Headless output: guest output is appended to an anonymous mapping and only
+// written to the capture file when the buffer fills, at HALT and at exit.
+// No stdio is involved, so OUT/PUTS/PUTSP cost a memory store each.
+extern int capture_enabled;
+
+// path "-" captures to standard output. Output past max bytes (0 for no
+// limit) is dropped and a truncation marker is written in its place.
+// Returns 0 if the file cannot be opened.
+int capture_open(const char *path, uint64_t max);
+void capture_putc(char c);
+void capture_write(const char *data, size_t n);
+
+// Write out everything buffered so far. Safe to call from a signal handler.
+void capture_flush(void);
+
+#endif
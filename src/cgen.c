@@ -0,0 +1,705 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "lc3.h"
+#include "jit.h"
+#include "predecode.h"
+#include "cgen.h"
+
+extern char **environ;
+
+typedef void (*bind_fn)(uint16_t *memory, const uint8_t *page_class, uint64_t *icount, uint16_t (*read)(uint16_t),
+                        int (*store)(uint16_t, uint16_t));
+
+enum
+{
+  IDLE,
+  BUILDING,
+  DONE,
+};
+
+static int started;
+static int threaded; // Builds run on builder_main(), not in cgen_request()
+static uint64_t *vm_icount; // The VM thread's, not the builder's
+static int broken; // A build failed, the compiler is probably missing
+
+// The one build in flight. state moves from IDLE to BUILDING on the VM
+// thread, to DONE on the builder thread and back to IDLE in cgen_collect().
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int state;
+static char *source;
+static size_t source_size;
+static struct cgen_region job;
+
+// What exit has to clean up while a build runs
+static char build_dir[32];
+static pid_t build_pid;
+
+// Emitter state, the index + 1 of each address in the region
+static uint16_t slot[MEMORY_MAX];
+static int32_t loop_end[CGEN_REGION_MAX]; // Last index of the loop headed at each index, or -1
+static uint16_t open_loops[CGEN_REGION_MAX];
+static uint16_t depth; // Of open_loops
+static uint16_t indent;
+static const uint16_t *emit_path;
+static uint16_t emit_count;
+static uint16_t returns[CGEN_REGION_MAX]; // After calls within the region
+static uint16_t return_count;
+static FILE *src;
+
+// Same instructions as the JIT compiles
+static int translatable(uint16_t address)
+{
+  uint16_t op = memory[address] >> 12;
+  return !(page_class[address >> PAGE_SHIFT] & PAGE_MMIO) && op != OP_TRAP && op != OP_RTI && op != OP_RES;
+}
+
+static int ascending(const void *a, const void *b)
+{
+  return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+uint16_t cgen_region(uint16_t head, uint16_t *path)
+{
+  static uint8_t seen[MEMORY_MAX];
+  if (!translatable(head))
+  {
+    return 0;
+  }
+  uint16_t count = 0;
+  path[count++] = head;
+  seen[head] = 1;
+  // path doubles as the work list
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    uint16_t address = path[i];
+    uint16_t instr = memory[address];
+    uint16_t next[2];
+    int k = 0;
+    switch (instr >> 12)
+    {
+    case OP_BR:
+    {
+      uint16_t nzp = (instr >> 9) & 7;
+      if (nzp)
+      {
+        next[k++] = address + 1 + sign_extend(instr & 0x1FF, 9);
+      }
+      if (nzp != 7)
+      {
+        next[k++] = address + 1;
+      }
+      break;
+    }
+    case OP_JSR:
+      if (instr & 0x800)
+      {
+        // The subroutine and where it returns to
+        next[k++] = address + 1 + sign_extend(instr & 0x7FF, 11);
+        next[k++] = address + 1;
+      }
+      break;
+    case OP_JMP:
+      break;
+    default:
+      next[k++] = address + 1;
+      break;
+    }
+    for (int j = 0; j < k; ++j)
+    {
+      if (!seen[next[j]] && count < CGEN_REGION_MAX && translatable(next[j]))
+      {
+        seen[next[j]] = 1;
+        path[count++] = next[j];
+      }
+    }
+  }
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    seen[path[i]] = 0;
+  }
+  qsort(path, count, sizeof(path[0]), ascending);
+  return count;
+}
+
+void cgen_emit_prelude(FILE *out)
+{
+  fprintf(out, "#include <stdint.h>\n\n");
+  fprintf(out, "static uint16_t *memory;\n");
+  fprintf(out, "static const uint8_t *page_class;\n");
+  fprintf(out, "static uint64_t *icount;\n");
+  fprintf(out, "static uint16_t (*read_slow)(uint16_t);\n");
+  fprintf(out, "static int (*write_slow)(uint16_t, uint16_t);\n\n");
+  fprintf(out, "void lc3_bind(uint16_t *m, const uint8_t *p, uint64_t *i, uint16_t (*r)(uint16_t), "
+               "int (*w)(uint16_t, uint16_t))\n");
+  fprintf(out, "{\n  memory = m;\n  page_class = p;\n  icount = i;\n  read_slow = r;\n  write_slow = w;\n}\n\n");
+  // Slow paths see icount counting the instruction in progress
+  fprintf(out, "static uint16_t load_slow(uint16_t a, uint32_t n)\n");
+  fprintf(out, "{\n  *icount += n;\n  uint16_t v = read_slow(a);\n  *icount -= n;\n  return v;\n}\n\n");
+  fprintf(out, "static int store_slow(uint16_t a, uint16_t v, uint32_t n)\n");
+  fprintf(out, "{\n  *icount += n;\n  int dropped = write_slow(a, v);\n  *icount -= n;\n  return dropped;\n}\n\n");
+  fprintf(out, "#define FLAGS(v) ((v) == 0 ? %d : (v) >> 15 ? %d : %d)\n", FL_ZRO, FL_NEG, FL_POS);
+  fprintf(out, "#define SPILL() (");
+  for (int g = 0; g < 8; ++g)
+  {
+    fprintf(out, "reg[%d] = r%d, ", g, g);
+  }
+  fprintf(out, "reg[%d] = cond)\n", R_COND);
+  fprintf(out, "#define LOAD(a) (page_class[(a) >> %d] & %d ? (SPILL(), load_slow((a), n)) : memory[(a)])\n\n",
+          PAGE_SHIFT, PAGE_READ_SLOW);
+}
+
+static void line(const char *format, ...)
+{
+  fprintf(src, "%*s", 2 + 2 * indent, "");
+  va_list args;
+  va_start(args, format);
+  vfprintf(src, format, args);
+  va_end(args);
+  fputc('\n', src);
+}
+
+// Continue at to from index i
+static void jump_to(uint16_t i, uint16_t to)
+{
+  if (!slot[to])
+  {
+    line("pc = 0x%04x;", to);
+    line("goto out;");
+    return;
+  }
+  if (to <= emit_path[i])
+  {
+    // Go round again only while a pass fits below limit
+    line("if (*icount + n + %u > limit)", emit_count);
+    line("{");
+    line("  pc = 0x%04x;", to);
+    line("  goto out;");
+    line("}");
+    if (depth && open_loops[depth - 1] == slot[to] - 1)
+    {
+      line("continue;");
+      return;
+    }
+  }
+  line("goto L%04x;", to);
+}
+
+// t = the word at a constant address. Device pages are fixed, so the check
+// is left out for the others.
+static void read_const(uint16_t address)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_READ_SLOW)
+  {
+    line("t = 0x%04x;", address);
+    line("t = LOAD(t);");
+  }
+  else
+  {
+    line("t = memory[0x%04x];", address);
+  }
+}
+
+// Store guest register r at t, leaving at next if that dropped generated code
+static void store(int r, uint16_t next)
+{
+  line("if (page_class[t >> %d] & %d)", PAGE_SHIFT, PAGE_WRITE_SLOW);
+  line("{");
+  line("  SPILL();");
+  line("  if (store_slow(t, r%d, n))", r);
+  line("  {");
+  line("    pc = 0x%04x;", next);
+  line("    goto out;");
+  line("  }");
+  line("}");
+  line("else");
+  line("{");
+  line("  memory[t] = r%d;", r);
+  line("}");
+}
+
+static void emit_insn(uint16_t i)
+{
+  uint16_t address = emit_path[i];
+  uint16_t instr = memory[address];
+  struct insn d = predecode_decode(address, instr);
+  uint16_t next = address + 1;
+
+  fprintf(src, "L%04x:\n", address);
+  line("++n;");
+  switch (instr >> 12)
+  {
+  case OP_ADD:
+  case OP_AND:
+  {
+    char op = (instr >> 12) == OP_ADD ? '+' : '&';
+    if (instr & 0x20)
+    {
+      line("r%d = r%d %c 0x%04x;", d.r0, d.r1, op, d.imm);
+    }
+    else
+    {
+      line("r%d = r%d %c r%d;", d.r0, d.r1, op, d.r2);
+    }
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  }
+  case OP_NOT:
+    line("r%d = ~r%d;", d.r0, d.r1);
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  case OP_LEA:
+    line("r%d = 0x%04x;", d.r0, d.imm);
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  case OP_LD:
+    read_const(d.imm);
+    line("r%d = t;", d.r0);
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  case OP_LDI:
+    read_const(d.imm);
+    line("r%d = LOAD(t);", d.r0);
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  case OP_LDR:
+    line("t = r%d + 0x%04x;", d.r1, d.imm);
+    line("r%d = LOAD(t);", d.r0);
+    line("cond = FLAGS(r%d);", d.r0);
+    break;
+  case OP_ST:
+    line("t = 0x%04x;", d.imm);
+    store(d.r0, next);
+    break;
+  case OP_STI:
+    read_const(d.imm);
+    store(d.r0, next);
+    break;
+  case OP_STR:
+    line("t = r%d + 0x%04x;", d.r1, d.imm);
+    store(d.r0, next);
+    break;
+  case OP_BR:
+    if (d.r0 == 7)
+    {
+      jump_to(i, d.imm);
+    }
+    else if (d.r0)
+    {
+      line("if (cond & %d)", d.r0);
+      line("{");
+      ++indent;
+      jump_to(i, d.imm);
+      --indent;
+      line("}");
+    }
+    break;
+  case OP_JMP:
+    if (d.r1 == R_R7)
+    {
+      // RET goes straight back to calls made in the region
+      for (uint16_t k = 0; k < return_count; ++k)
+      {
+        line("if (r7 == 0x%04x)", returns[k]);
+        line("{");
+        ++indent;
+        jump_to(i, returns[k]);
+        --indent;
+        line("}");
+      }
+    }
+    line("pc = r%d;", d.r1);
+    line("goto out;");
+    break;
+  case OP_JSR:
+    // R7 is written first, as in execute()
+    line("r7 = 0x%04x;", next);
+    if (instr & 0x800)
+    {
+      jump_to(i, d.imm);
+    }
+    else
+    {
+      line("pc = r%d;", d.r1);
+      line("goto out;");
+    }
+    break;
+  }
+}
+
+static int falls_through(uint16_t instr)
+{
+  uint16_t op = instr >> 12;
+  return !(op == OP_JMP || op == OP_JSR || (op == OP_BR && (instr & 0x0E00) == 0x0E00));
+}
+
+// Backward branches make loops around the code from their target to the
+// last of them. Loops that would overlap without nesting stay gotos.
+static void find_loops()
+{
+  for (uint16_t i = 0; i < emit_count; ++i)
+  {
+    loop_end[i] = -1;
+  }
+  for (uint16_t i = 0; i < emit_count; ++i)
+  {
+    uint16_t instr = memory[emit_path[i]];
+    if ((instr >> 12) == OP_BR && (instr & 0x0E00))
+    {
+      uint16_t target = emit_path[i] + 1 + sign_extend(instr & 0x1FF, 9);
+      if (slot[target] && slot[target] - 1 <= i && loop_end[slot[target] - 1] < i)
+      {
+        loop_end[slot[target] - 1] = i;
+      }
+    }
+  }
+  uint16_t nest = 0;
+  for (uint16_t i = 0; i < emit_count; ++i)
+  {
+    if (loop_end[i] < 0)
+    {
+      continue;
+    }
+    while (nest && loop_end[open_loops[nest - 1]] < i)
+    {
+      --nest;
+    }
+    if (nest && loop_end[i] > loop_end[open_loops[nest - 1]])
+    {
+      loop_end[i] = -1;
+    }
+    else
+    {
+      open_loops[nest++] = i;
+    }
+  }
+}
+
+void cgen_emit(FILE *out, const char *name, const uint16_t *path, uint16_t count, uint16_t head)
+{
+  src = out;
+  emit_path = path;
+  emit_count = count;
+  depth = 0;
+  indent = 0;
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    slot[path[i]] = i + 1;
+  }
+  find_loops();
+  return_count = 0;
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    uint16_t instr = memory[path[i]];
+    if ((instr >> 12) == OP_JSR && (instr & 0x800) && slot[(uint16_t)(path[i] + 1)])
+    {
+      returns[return_count++] = path[i] + 1;
+    }
+  }
+
+  fprintf(out, "uint32_t %s(uint16_t *reg, uint64_t limit)\n{\n", name);
+  for (int g = 0; g < 8; ++g)
+  {
+    line("uint16_t r%d = reg[%d];", g, g);
+  }
+  line("uint16_t cond = reg[%d];", R_COND);
+  line("uint16_t pc, t;");
+  line("uint32_t n = 0;");
+  if (head != path[0])
+  {
+    line("goto L%04x;", head);
+  }
+
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    if (loop_end[i] >= 0)
+    {
+      line("for (;;)");
+      line("{");
+      open_loops[depth++] = i;
+      ++indent;
+    }
+    emit_insn(i);
+    uint16_t instr = memory[path[i]];
+    uint16_t next = path[i] + 1;
+    int closes = depth && loop_end[open_loops[depth - 1]] == i;
+    if (falls_through(instr) && (closes || i + 1 == count || path[i + 1] != next))
+    {
+      jump_to(i, next);
+    }
+    while (depth && loop_end[open_loops[depth - 1]] == i)
+    {
+      --depth;
+      --indent;
+      line("}");
+    }
+  }
+
+  fprintf(out, "out:\n");
+  line("SPILL();");
+  line("reg[%d] = pc;", R_PC);
+  line("return n;");
+  fprintf(out, "}\n");
+
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    slot[path[i]] = 0;
+  }
+}
+
+static int store_word(uint16_t address, uint16_t value)
+{
+  jit_dropped = 0;
+  mem_write_slow(address, value);
+  return jit_dropped;
+}
+
+// Run the compiler with its output out of the guest's terminal and its
+// temporary files in dir
+static int run_cc(const char *dir, const char *c_path, const char *so_path)
+{
+  char *argv[] = {"gcc", "-O2", "-shared", "-fPIC", "-w", "-o", (char *)so_path, (char *)c_path, NULL};
+  size_t count = 0;
+  while (environ[count])
+  {
+    ++count;
+  }
+  char **env = malloc(sizeof(env[0]) * (count + 2));
+  if (!env)
+  {
+    return 0;
+  }
+  char tmpdir[64];
+  snprintf(tmpdir, sizeof(tmpdir), "TMPDIR=%s", dir);
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (strncmp(environ[i], "TMPDIR=", 7))
+    {
+      env[kept++] = environ[i];
+    }
+  }
+  env[kept++] = tmpdir;
+  env[kept] = NULL;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (int fd = 0; fd < 3; ++fd)
+  {
+    posix_spawn_file_actions_addopen(&actions, fd, "/dev/null", fd ? O_WRONLY : O_RDONLY, 0);
+  }
+  // In a process group of its own, so exit can stop it with its children
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+  pid_t pid;
+  int status = -1;
+  if (posix_spawnp(&pid, argv[0], &actions, &attr, argv, env) == 0)
+  {
+    __atomic_store_n(&build_pid, pid, __ATOMIC_RELAXED);
+    while (waitpid(pid, &status, 0) < 0)
+    {
+    }
+    __atomic_store_n(&build_pid, 0, __ATOMIC_RELAXED);
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  free(env);
+  return status == 0;
+}
+
+static void remove_build(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (d)
+  {
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+      if (e->d_name[0] != '.')
+      {
+        char path[320];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir);
+}
+
+// The VM may halt while a build runs
+static void stop_build()
+{
+  pid_t pid = __atomic_load_n(&build_pid, __ATOMIC_RELAXED);
+  if (pid > 0)
+  {
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+  if (build_dir[0])
+  {
+    remove_build(build_dir);
+  }
+}
+
+static jit_fn build(const char *text, size_t size)
+{
+  char dir[] = "/tmp/lc3-cgen-XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    return NULL;
+  }
+  memcpy(build_dir, dir, sizeof(dir));
+  char c_path[64], so_path[64];
+  snprintf(c_path, sizeof(c_path), "%s/region.c", dir);
+  snprintf(so_path, sizeof(so_path), "%s/region.so", dir);
+
+  void *handle = NULL;
+  FILE *f = fopen(c_path, "w");
+  if (f)
+  {
+    int written = fwrite(text, 1, size, f) == size;
+    if (fclose(f) == 0 && written && run_cc(dir, c_path, so_path))
+    {
+      handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    }
+  }
+  remove_build(dir);
+  build_dir[0] = 0;
+  if (!handle)
+  {
+    return NULL;
+  }
+
+  // The object stays loaded for the rest of the run, as code that was
+  // dropped may still be on its way out
+  bind_fn bind = (bind_fn)dlsym(handle, "lc3_bind");
+  jit_fn fn = (jit_fn)dlsym(handle, "lc3_region");
+  if (!bind || !fn)
+  {
+    dlclose(handle);
+    return NULL;
+  }
+  bind(memory, page_class, vm_icount, mem_read_slow, store_word);
+  return fn;
+}
+
+static void *builder_main(void *unused)
+{
+  (void)unused;
+  pthread_mutex_lock(&lock);
+  for (;;)
+  {
+    while (state != BUILDING)
+    {
+      pthread_cond_wait(&wake, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    jit_fn fn = build(source, source_size);
+
+    pthread_mutex_lock(&lock);
+    free(source);
+    source = NULL;
+    job.fn = fn;
+    broken |= !fn;
+    __atomic_store_n(&state, DONE, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+int cgen_init(int background)
+{
+  vm_icount = &icount;
+  if (!background)
+  {
+    started = 1;
+    atexit(stop_build);
+    return 1;
+  }
+  threaded = 1;
+  // Signals are for the VM thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  started = pthread_create(&thread, NULL, builder_main, NULL) == 0;
+  if (started)
+  {
+    pthread_detach(thread);
+    atexit(stop_build);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started;
+}
+
+int cgen_request(uint16_t head, const uint16_t *path, uint16_t count, uint32_t tag)
+{
+  if (!started || count == 0 || __atomic_load_n(&state, __ATOMIC_ACQUIRE) != IDLE || broken)
+  {
+    return 0;
+  }
+  uint16_t *copy = malloc(sizeof(path[0]) * count);
+  char *text = NULL;
+  size_t size = 0;
+  FILE *out = copy ? open_memstream(&text, &size) : NULL;
+  if (!out)
+  {
+    free(copy);
+    return 0;
+  }
+  cgen_emit_prelude(out);
+  cgen_emit(out, "lc3_region", path, count, head);
+  if (fclose(out) != 0)
+  {
+    free(text);
+    free(copy);
+    return 0;
+  }
+  memcpy(copy, path, sizeof(path[0]) * count);
+
+  if (!threaded)
+  {
+    job = (struct cgen_region){.head = head, .length = count, .count = count, .path = copy, .tag = tag};
+    job.fn = build(text, size);
+    broken |= !job.fn;
+    free(text);
+    state = DONE;
+    return 1;
+  }
+  pthread_mutex_lock(&lock);
+  source = text;
+  source_size = size;
+  job = (struct cgen_region){.head = head, .length = count, .count = count, .path = copy, .tag = tag};
+  state = BUILDING;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
+
+int cgen_collect(struct cgen_region *out)
+{
+  if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != DONE)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&lock);
+  *out = job;
+  state = IDLE;
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef CGEN_H
+#define CGEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jit.h"
+
+// Most guest instructions translated in one region
+#define CGEN_REGION_MAX 1024
+
+// A region of guest code translated to C, built into a shared object by the
+// host C compiler and loaded back. Its function follows the jit_fn contract:
+// it runs with the guest registers at reg, returns how many instructions it
+// executed and only goes round a loop again while length more fit below
+// limit.
+struct cgen_region
+{
+  jit_fn fn; // NULL when the build failed
+  uint16_t head;
+  uint16_t length; // Most instructions run between limit checks
+  uint16_t count;
+  uint16_t *path; // malloc'd, the translated addresses in ascending order
+  uint32_t tag;   // Passed to cgen_request()
+};
+
+// Starts the thread that runs the compiler, or without background has
+// cgen_request() build on the calling thread. Returns 0 if it cannot run.
+int cgen_init(int background);
+
+// The addresses of the region reachable from head through fall-through,
+// direct branches and JSR, in ascending order. Instructions the JIT leaves to
+// execute(), JMP and JSRR end it. Returns how many there are.
+uint16_t cgen_region(uint16_t head, uint16_t *path);
+
+// Write the declarations generated functions need, once per source file.
+// The object exports lc3_bind(), to be called with the VM's memory,
+// page_class, icount and slow paths before any function runs.
+void cgen_emit_prelude(FILE *out);
+
+// Write the function name for the count addresses at path, ascending and
+// entered at head. Each guest register becomes a local so the compiler can
+// keep it in a host register, each backward branch becomes a loop where the
+// loops nest, and RET goes straight back to calls made in the region. Only
+// reads guest memory, on the VM thread.
+void cgen_emit(FILE *out, const char *name, const uint16_t *path, uint16_t count, uint16_t head);
+
+// Translate the region at path now and build it in the background. Returns 0
+// if a build is already running or building has failed before.
+int cgen_request(uint16_t head, const uint16_t *path, uint16_t count, uint32_t tag);
+
+// Take the finished build, if any. Returns 1 and fills out when there is one.
+int cgen_collect(struct cgen_region *out);
+
+#endif
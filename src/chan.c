@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "lc3.h"
+#include "stats.h"
+#include "debugger.h"
+#include "chan.h"
+
+// How long a parked side sleeps before it checks the other one is alive
+#define PARK_NS 100000000
+
+struct side
+{
+  struct chan_ring *ring;
+  char name[64];
+  uint32_t index; // Own index, only this process writes it
+  uint32_t other; // Last seen index of the other side
+};
+
+static struct side in;
+static struct side out;
+
+static int open_ring(struct side *side, const char *name)
+{
+  snprintf(side->name, sizeof(side->name), CHAN_PREFIX "%s", name);
+  int fd = shm_open(side->name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  // Zero filled, which is an empty ring, for whichever side comes first
+  if (ftruncate(fd, sizeof(struct chan_ring)) != 0)
+  {
+    close(fd);
+    return 0;
+  }
+  side->ring = mmap(NULL, sizeof(struct chan_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (side->ring == MAP_FAILED)
+  {
+    side->ring = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void close_in()
+{
+  shm_unlink(in.name);
+}
+
+static void close_out()
+{
+  struct chan_ring *ring = out.ring;
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->reader_parked, __ATOMIC_SEQ_CST))
+  {
+    syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+int chan_open_in(const char *name)
+{
+  if (!open_ring(&in, name))
+  {
+    return 0;
+  }
+  __atomic_store_n(&in.ring->reader, (int32_t)getpid(), __ATOMIC_RELAXED);
+  in.index = __atomic_load_n(&in.ring->head, __ATOMIC_RELAXED);
+  in.other = __atomic_load_n(&in.ring->tail, __ATOMIC_ACQUIRE);
+  atexit(close_in);
+  return 1;
+}
+
+int chan_open_out(const char *name)
+{
+  if (!open_ring(&out, name))
+  {
+    return 0;
+  }
+  __atomic_store_n(&out.ring->closed, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&out.ring->writer, (int32_t)getpid(), __ATOMIC_RELAXED);
+  out.index = __atomic_load_n(&out.ring->tail, __ATOMIC_RELAXED);
+  out.other = __atomic_load_n(&out.ring->head, __ATOMIC_ACQUIRE);
+  atexit(close_out);
+  return 1;
+}
+
+// Whether the process at pid has gone. 0 is one that has not opened the
+// channel yet.
+static int gone(const int32_t *pid)
+{
+  int32_t p = __atomic_load_n(pid, __ATOMIC_RELAXED);
+  return p && kill(p, 0) != 0;
+}
+
+// Sleep until *word moves away from seen, or for PARK_NS. parked tells the
+// other side to wake us, and is set before *word is checked again so a move
+// in between is never missed.
+static void park(uint32_t *word, uint32_t seen, uint32_t *parked)
+{
+  if (stats_enabled)
+  {
+    stats_publish(STATS_BLOCKED);
+  }
+  __atomic_store_n(parked, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+  {
+    struct timespec timeout = {0, PARK_NS};
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+  }
+  __atomic_store_n(parked, 0, __ATOMIC_RELAXED);
+  if (stats_enabled)
+  {
+    stats_publish(STATS_RUNNING);
+  }
+}
+
+// Publish a moved index and wake the other side if it parked on it
+static void publish(uint32_t *word, uint32_t value, uint32_t *parked)
+{
+  __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(parked, __ATOMIC_SEQ_CST))
+  {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+static int rx_ready()
+{
+  if (in.index == in.other)
+  {
+    in.other = __atomic_load_n(&in.ring->tail, __ATOMIC_ACQUIRE);
+  }
+  return in.index != in.other;
+}
+
+// Nothing left and nothing more coming
+static int rx_ended()
+{
+  struct chan_ring *ring = in.ring;
+  if (!ring)
+  {
+    return 1;
+  }
+  if (rx_ready())
+  {
+    return 0;
+  }
+  if (!__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) && !gone(&ring->writer))
+  {
+    return 0;
+  }
+  // The last words may have landed just before the close
+  return !rx_ready();
+}
+
+static uint16_t rx_take()
+{
+  while (!rx_ready())
+  {
+    if (rx_ended() || vm_interrupted)
+    {
+      return 0;
+    }
+    park(&in.ring->tail, in.other, &in.ring->reader_parked);
+  }
+  uint16_t value = in.ring->data[in.index % CHAN_WORDS];
+  publish(&in.ring->head, ++in.index, &in.ring->writer_parked);
+  return value;
+}
+
+static int tx_room()
+{
+  if (out.index - out.other == CHAN_WORDS)
+  {
+    out.other = __atomic_load_n(&out.ring->head, __ATOMIC_ACQUIRE);
+  }
+  return out.index - out.other < CHAN_WORDS;
+}
+
+static void tx_put(uint16_t value)
+{
+  struct chan_ring *ring = out.ring;
+  if (!ring)
+  {
+    return;
+  }
+  while (!tx_room())
+  {
+    if (gone(&ring->reader) || vm_interrupted)
+    {
+      return;
+    }
+    park(&ring->head, out.other, &ring->writer_parked);
+  }
+  ring->data[out.index % CHAN_WORDS] = value;
+  publish(&ring->tail, ++out.index, &ring->reader_parked);
+}
+
+static int rx_status()
+{
+  if (in.ring && rx_ready())
+  {
+    return 1 << 15;
+  }
+  return rx_ended() ? 1 << 14 : 0;
+}
+
+static int rx_data()
+{
+  return rx_take();
+}
+
+static int tx_status()
+{
+  return !out.ring || tx_room() ? 1 << 15 : 0;
+}
+
+uint16_t chan_read(uint16_t address)
+{
+  int (*source)(void) = NULL;
+  switch (address)
+  {
+  case MR_RXSR:
+    source = rx_status;
+    break;
+  case MR_RXDR:
+    source = rx_data;
+    break;
+  case MR_TXSR:
+    source = tx_status;
+    break;
+  default:
+    return 0;
+  }
+  // Logged like keys, so replaying history neither takes words off the ring
+  // again nor sees a different status
+  return (uint16_t)(debug_enabled ? debug_input(source) : source());
+}
+
+void chan_write(uint16_t address, uint16_t value)
+{
+  // The reader already has what history sends again
+  if (address == MR_TXDR && !(debug_enabled && debug_replaying()))
+  {
+    tx_put(value);
+  }
+}
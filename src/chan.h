@@ -0,0 +1,46 @@
+#ifndef CHAN_H
+#define CHAN_H
+
+#include <stdint.h>
+
+// Words a channel holds before its writer has to wait
+#define CHAN_WORDS 4096
+
+// Channels are the shared-memory segments /dev/shm/lc3chan-NAME
+#define CHAN_PREFIX "/lc3chan-"
+
+// A channel is a ring of words in shared memory with one VM writing and one
+// reading, so a pipeline of guest programs runs as separate processes on
+// separate host cores. Each side only writes its own index and caches the
+// other's, and the indices and data sit on separate cache lines. A side
+// that finds the ring empty or full parks on a futex until the other one
+// moves its index, and is only woken when it said it was parked.
+struct chan_ring
+{
+  int32_t writer; // pid, 0 until one opens the channel
+  int32_t reader;
+  _Alignas(64) uint32_t tail; // Written by the writer
+  uint32_t closed;            // The writer has exited
+  uint32_t reader_parked;
+  _Alignas(64) uint32_t head; // Written by the reader
+  uint32_t writer_parked;
+  _Alignas(64) uint16_t data[CHAN_WORDS];
+};
+
+// Open the channel the guest reads from MR_RXDR, creating it if the writer
+// has not yet. The reader removes it at exit. Returns 0 on failure.
+int chan_open_in(const char *name);
+
+// Open the channel the guest writes to MR_TXDR, creating it if the reader
+// has not yet. It is marked closed at exit. Returns 0 on failure.
+int chan_open_out(const char *name);
+
+// MR_RXSR to MR_TXDR. Reading MR_RXDR waits for a word and returns 0 once
+// the writer has closed the channel and it is empty; writing MR_TXDR waits
+// for room. Without a channel, input is at its end and output is dropped.
+// Under the debugger, reads go through the input log and writes made while
+// replaying history are dropped.
+uint16_t chan_read(uint16_t address);
+void chan_write(uint16_t address, uint16_t value);
+
+#endif
@@ -0,0 +1,1002 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "debugger.h"
+#include "predecode.h"
+#include "predicate.h"
+
+// Once this many checkpoints exist every other one is merged away
+#define CHECKPOINT_MAX 1024
+
+// What run_forward does when it reaches a breakpoint
+enum
+{
+  BREAKS_STOP,
+  BREAKS_IGNORE,
+  BREAKS_RECORD, // Remember the last one in last_hit and keep going
+};
+
+int debug_enabled;
+volatile sig_atomic_t debug_interrupted;
+int (*debug_poll)(void);
+
+// Contents of a page just before its first write after a checkpoint. Pages
+// are classed PAGE_TRACK until then so only that first write is slowed down.
+struct page_copy
+{
+  uint16_t page;
+  uint16_t data[PAGE_SIZE];
+};
+
+struct checkpoint
+{
+  uint64_t icount;
+  uint16_t reg[R_COUNT];
+  int running;
+  size_t input_pos;
+  struct page_copy *pages;
+  size_t page_count;
+  size_t page_cap;
+};
+
+static struct checkpoint checkpoints[CHECKPOINT_MAX];
+static size_t checkpoint_count;
+static uint64_t checkpoint_interval;
+static uint64_t next_checkpoint;
+
+// Set when the debugger changed registers or memory behind the guest's back
+static int history_dirty;
+
+// Furthest point ever executed. icount already counts the instruction being
+// executed, so anything up to and including it is a replay.
+static uint64_t icount_high;
+
+// Every value the guest read from the keyboard, in order
+static int16_t *input_log;
+static size_t input_len;
+static size_t input_cap;
+static size_t input_pos;
+
+static uint8_t breakpoints[MEMORY_MAX];
+static struct predicate *conditions[MEMORY_MAX];
+static char *condition_text[MEMORY_MAX];
+
+#define WATCH_MAX 16
+
+struct watchpoint
+{
+  int kind; // WATCH_* bits, zero if the slot is free
+  uint16_t start;
+  uint16_t end; // Inclusive
+};
+
+static struct watchpoint watchpoints[WATCH_MAX];
+
+struct watch_hit watch_hit;
+static int watch_triggered;
+
+static void *xrealloc(void *p, size_t size)
+{
+  p = realloc(p, size);
+  if (!p)
+  {
+    fprintf(stderr, "debugger: out of memory\n");
+    abort();
+  }
+  return p;
+}
+
+// Input log
+int debug_input(int (*source)(void))
+{
+  if (input_pos < input_len)
+  {
+    return input_log[input_pos++];
+  }
+  int value = source();
+  if (input_len == input_cap)
+  {
+    input_cap = input_cap ? input_cap * 2 : 1024;
+    input_log = xrealloc(input_log, input_cap * sizeof(*input_log));
+  }
+  input_log[input_len++] = (int16_t)value;
+  input_pos = input_len;
+  return value;
+}
+
+int debug_replaying()
+{
+  return icount <= icount_high;
+}
+
+// Checkpoints
+void debug_track_write(uint16_t address)
+{
+  uint16_t page = address >> PAGE_SHIFT;
+  page_class[page] &= ~PAGE_TRACK;
+
+  struct checkpoint *cp = &checkpoints[checkpoint_count - 1];
+  if (cp->page_count == cp->page_cap)
+  {
+    cp->page_cap = cp->page_cap ? cp->page_cap * 2 : 8;
+    cp->pages = xrealloc(cp->pages, cp->page_cap * sizeof(*cp->pages));
+  }
+  struct page_copy *copy = &cp->pages[cp->page_count++];
+  copy->page = page;
+  memcpy(copy->data, memory + (page << PAGE_SHIFT), sizeof(copy->data));
+}
+
+// Fold checkpoint i into its predecessor. The older pre-image of a page wins
+// since it is the one needed to rewind to the predecessor.
+static void checkpoint_merge(size_t i)
+{
+  struct checkpoint *prev = &checkpoints[i - 1];
+  struct checkpoint *cp = &checkpoints[i];
+  uint8_t present[PAGE_COUNT] = {0};
+
+  for (size_t p = 0; p < prev->page_count; ++p)
+  {
+    present[prev->pages[p].page] = 1;
+  }
+  for (size_t p = 0; p < cp->page_count; ++p)
+  {
+    if (present[cp->pages[p].page])
+    {
+      continue;
+    }
+    if (prev->page_count == prev->page_cap)
+    {
+      prev->page_cap = prev->page_cap ? prev->page_cap * 2 : 8;
+      prev->pages = xrealloc(prev->pages, prev->page_cap * sizeof(*prev->pages));
+    }
+    prev->pages[prev->page_count++] = cp->pages[p];
+  }
+  free(cp->pages);
+  memmove(cp, cp + 1, (checkpoint_count - i - 1) * sizeof(*cp));
+  --checkpoint_count;
+}
+
+static void track_all_pages()
+{
+  for (int page = 0; page < PAGE_COUNT; ++page)
+  {
+    page_class[page] |= PAGE_TRACK;
+  }
+}
+
+static void checkpoint_take()
+{
+  if (checkpoint_count == CHECKPOINT_MAX)
+  {
+    // Thin out history, keeping the first and the latest checkpoint
+    for (size_t i = 1; i + 1 < checkpoint_count; ++i)
+    {
+      checkpoint_merge(i);
+    }
+    checkpoint_interval *= 2;
+  }
+
+  struct checkpoint *cp = &checkpoints[checkpoint_count++];
+  memset(cp, 0, sizeof(*cp));
+  cp->icount = icount;
+  memcpy(cp->reg, reg, sizeof(cp->reg));
+  cp->running = running;
+  cp->input_pos = input_pos;
+  track_all_pages();
+  next_checkpoint = icount + checkpoint_interval;
+}
+
+// Rewind to checkpoint k by undoing the newer checkpoints one by one
+static void checkpoint_restore(size_t k)
+{
+  for (size_t i = checkpoint_count; i-- > k;)
+  {
+    struct checkpoint *cp = &checkpoints[i];
+    for (size_t p = cp->page_count; p-- > 0;)
+    {
+      uint16_t base = cp->pages[p].page << PAGE_SHIFT;
+      if (page_class[cp->pages[p].page] & PAGE_CODE)
+      {
+        for (int a = 0; a < PAGE_SIZE; ++a)
+        {
+          predecode_invalidate(base + a);
+        }
+      }
+      memcpy(memory + base, cp->pages[p].data, sizeof(cp->pages[p].data));
+    }
+    cp->page_count = 0;
+    if (i > k)
+    {
+      free(cp->pages);
+    }
+  }
+  checkpoint_count = k + 1;
+  track_all_pages();
+
+  struct checkpoint *cp = &checkpoints[k];
+  icount = cp->icount;
+  memcpy(reg, cp->reg, sizeof(reg));
+  running = cp->running;
+  input_pos = cp->input_pos;
+  next_checkpoint = icount + checkpoint_interval;
+}
+
+// Latest checkpoint taken strictly before the given instruction count
+static size_t checkpoint_before(uint64_t count)
+{
+  size_t k = checkpoint_count;
+  while (k > 1 && checkpoints[k - 1].icount >= count)
+  {
+    --k;
+  }
+  return k - 1;
+}
+
+// Latest stop found by a BREAKS_RECORD run
+static uint64_t last_hit;
+static int last_hit_reason;
+static struct watch_hit last_watch;
+
+// Deal with a watchpoint triggered by the instruction that just ran,
+// returns 1 if the run has to stop
+static int watch_check(uint64_t target, int breaks)
+{
+  if (!watch_triggered)
+  {
+    return 0;
+  }
+  watch_triggered = 0;
+  if (breaks == BREAKS_STOP)
+  {
+    return 1;
+  }
+  if (breaks == BREAKS_RECORD && icount < target)
+  {
+    last_hit = icount;
+    last_hit_reason = STOP_WATCH;
+    last_watch = watch_hit;
+  }
+  return 0;
+}
+
+static int run_forward(uint64_t target, int breaks)
+{
+  uint64_t start = icount;
+  watch_triggered = 0;
+  while (running && icount < target)
+  {
+    if (icount == next_checkpoint)
+    {
+      checkpoint_take();
+    }
+    if (debug_interrupted || (debug_poll && debug_poll()))
+    {
+      debug_interrupted = 0;
+      return STOP_INTERRUPT;
+    }
+
+    uint64_t limit = target;
+    if (limit > next_checkpoint)
+    {
+      limit = next_checkpoint;
+    }
+    if (limit - icount > VM_SLICE)
+    {
+      limit = icount + VM_SLICE;
+    }
+    int at_break = predecode_run(limit);
+    vm_tick();
+    if (watch_check(target, breaks))
+    {
+      return STOP_WATCH;
+    }
+    if (at_break)
+    {
+      if (breaks == BREAKS_STOP && icount != start)
+      {
+        return STOP_BREAK;
+      }
+      if (breaks == BREAKS_RECORD)
+      {
+        last_hit = icount;
+        last_hit_reason = STOP_BREAK;
+      }
+      predecode_step_over();
+      if (watch_check(target, breaks))
+      {
+        return STOP_WATCH;
+      }
+    }
+    if (icount > icount_high)
+    {
+      icount_high = icount;
+    }
+  }
+  return running ? STOP_STEP : STOP_HALT;
+}
+
+// Changing state from the debugger invalidates the recorded history, so it
+// restarts at the current instruction before the guest runs again
+static void history_rebase()
+{
+  if (!history_dirty)
+  {
+    return;
+  }
+  history_dirty = 0;
+  for (size_t i = 0; i < checkpoint_count; ++i)
+  {
+    free(checkpoints[i].pages);
+  }
+  checkpoint_count = 0;
+  icount_high = icount;
+  // Keys read after this point belong to the discarded timeline
+  input_len = input_pos;
+  checkpoint_take();
+}
+
+void debug_poke_memory(uint16_t address, uint16_t value)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_CODE)
+  {
+    predecode_invalidate(address);
+  }
+  memory[address] = value;
+  history_dirty = 1;
+}
+
+void debug_poke_register(int r, uint16_t value)
+{
+  reg[r] = value;
+  history_dirty = 1;
+}
+
+// Execution control
+int debug_step(uint64_t count)
+{
+  history_rebase();
+  return run_forward(icount + count, BREAKS_STOP);
+}
+
+int debug_continue()
+{
+  history_rebase();
+  return run_forward(UINT64_MAX, BREAKS_STOP);
+}
+
+int debug_reverse_step(uint64_t count)
+{
+  int reason = STOP_STEP;
+  history_rebase();
+  if (count > icount - checkpoints[0].icount)
+  {
+    count = icount - checkpoints[0].icount;
+    reason = STOP_HISTORY;
+  }
+  uint64_t target = icount - count;
+  checkpoint_restore(checkpoint_before(target + 1));
+  run_forward(target, BREAKS_IGNORE);
+  return reason;
+}
+
+int debug_reverse_continue()
+{
+  uint64_t end = icount;
+  history_rebase();
+  while (end > checkpoints[0].icount)
+  {
+    // Replay the interval before end, remembering the last breakpoint reached
+    size_t k = checkpoint_before(end);
+    checkpoint_restore(k);
+
+    last_hit = UINT64_MAX;
+    run_forward(end, BREAKS_RECORD);
+    if (last_hit != UINT64_MAX)
+    {
+      uint64_t hit = last_hit;
+      int reason = last_hit_reason;
+      struct watch_hit watch = last_watch;
+      checkpoint_restore(k);
+      run_forward(hit, BREAKS_IGNORE);
+      watch_hit = watch;
+      return reason;
+    }
+    end = checkpoints[k].icount;
+  }
+  checkpoint_restore(0);
+  return STOP_HISTORY;
+}
+
+// Breakpoints
+int debug_break_add(uint16_t address)
+{
+  if (breakpoints[address])
+  {
+    return 0;
+  }
+  breakpoints[address] = 1;
+  predecode_set_break(address, 1, NULL);
+  return 1;
+}
+
+int debug_break_condition(uint16_t address, const char *text, char *error, size_t error_size)
+{
+  struct predicate *condition = NULL;
+  if (!breakpoints[address])
+  {
+    snprintf(error, error_size, "no breakpoint at x%04X", address);
+    return 0;
+  }
+  if (text && *text)
+  {
+    condition = xrealloc(NULL, sizeof(*condition));
+    if (!predicate_compile(text, condition, error, error_size))
+    {
+      free(condition);
+      return 0;
+    }
+  }
+  predecode_set_break(address, 1, condition);
+  free(conditions[address]);
+  free(condition_text[address]);
+  conditions[address] = condition;
+  condition_text[address] = condition ? strdup(text) : NULL;
+  return 1;
+}
+
+int debug_break_remove(uint16_t address)
+{
+  if (!breakpoints[address])
+  {
+    return 0;
+  }
+  breakpoints[address] = 0;
+  predecode_set_break(address, 0, NULL);
+  free(conditions[address]);
+  free(condition_text[address]);
+  conditions[address] = NULL;
+  condition_text[address] = NULL;
+  return 1;
+}
+
+// Watchpoints
+static void watch_update_pages()
+{
+  for (int page = 0; page < PAGE_COUNT; ++page)
+  {
+    page_class[page] &= ~(PAGE_WATCH_READ | PAGE_WATCH_WRITE);
+  }
+  for (int id = 0; id < WATCH_MAX; ++id)
+  {
+    struct watchpoint *w = &watchpoints[id];
+    uint8_t cls = 0;
+    if (w->kind & WATCH_READ)
+    {
+      cls |= PAGE_WATCH_READ;
+    }
+    if (w->kind & (WATCH_WRITE | WATCH_CHANGE))
+    {
+      cls |= PAGE_WATCH_WRITE;
+    }
+    for (int page = w->start >> PAGE_SHIFT; cls && page <= w->end >> PAGE_SHIFT; ++page)
+    {
+      page_class[page] |= cls;
+    }
+  }
+}
+
+static void watch_match(uint16_t address, int kind, uint16_t old_value, uint16_t new_value)
+{
+  for (int id = 0; id < WATCH_MAX; ++id)
+  {
+    struct watchpoint *w = &watchpoints[id];
+    if ((w->kind & kind) && address >= w->start && address <= w->end)
+    {
+      watch_hit.id = id;
+      watch_hit.kind = w->kind & kind;
+      watch_hit.address = address;
+      watch_hit.old_value = old_value;
+      watch_hit.new_value = new_value;
+      watch_triggered = 1;
+      predecode_stop();
+      return;
+    }
+  }
+}
+
+void debug_watch_read(uint16_t address)
+{
+  watch_match(address, WATCH_READ, memory[address], memory[address]);
+}
+
+void debug_watch_write(uint16_t address, uint16_t value)
+{
+  int kind = WATCH_WRITE;
+  if (memory[address] != value)
+  {
+    kind |= WATCH_CHANGE;
+  }
+  watch_match(address, kind, memory[address], value);
+}
+
+int debug_watch_find(uint16_t start, uint16_t end, int kind)
+{
+  for (int id = 0; id < WATCH_MAX; ++id)
+  {
+    struct watchpoint *w = &watchpoints[id];
+    if (w->kind == kind && w->start == start && w->end == end)
+    {
+      return id;
+    }
+  }
+  return -1;
+}
+
+int debug_watch_add(uint16_t start, uint16_t end, int kind)
+{
+  if (end < start)
+  {
+    return -1;
+  }
+  for (int id = 0; id < WATCH_MAX; ++id)
+  {
+    if (!watchpoints[id].kind)
+    {
+      watchpoints[id].kind = kind;
+      watchpoints[id].start = start;
+      watchpoints[id].end = end;
+      watch_update_pages();
+      return id;
+    }
+  }
+  return -1;
+}
+
+int debug_watch_remove(int id)
+{
+  if (id < 0 || id >= WATCH_MAX || !watchpoints[id].kind)
+  {
+    return 0;
+  }
+  watchpoints[id].kind = 0;
+  watch_update_pages();
+  return 1;
+}
+
+void debug_detach()
+{
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    debug_break_remove(a);
+  }
+  for (int id = 0; id < WATCH_MAX; ++id)
+  {
+    watchpoints[id].kind = 0;
+  }
+  watch_update_pages();
+  for (size_t i = 0; i < checkpoint_count; ++i)
+  {
+    free(checkpoints[i].pages);
+  }
+  checkpoint_count = 0;
+  for (int page = 0; page < PAGE_COUNT; ++page)
+  {
+    page_class[page] &= ~PAGE_TRACK;
+  }
+  debug_enabled = 0;
+}
+
+void debug_init(uint64_t interval)
+{
+  debug_enabled = 1;
+  predecode_init();
+  checkpoint_interval = interval;
+  checkpoint_take();
+}
+
+// Command line interface
+static const char *trap_name(uint16_t vector)
+{
+  switch (vector)
+  {
+  case TRAP_GETC:
+    return "GETC";
+  case TRAP_OUT:
+    return "OUT";
+  case TRAP_PUTS:
+    return "PUTS";
+  case TRAP_IN:
+    return "IN";
+  case TRAP_PUTSP:
+    return "PUTSP";
+  case TRAP_HALT:
+    return "HALT";
+  }
+  return NULL;
+}
+
+static void disassemble(uint16_t address, uint16_t instr, char *buf, size_t size)
+{
+  static const char *names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+  uint16_t opcode = instr >> 12;
+  int r0 = (instr >> 9) & 0x7;
+  int r1 = (instr >> 6) & 0x7;
+  uint16_t next = address + 1;
+
+  switch (opcode)
+  {
+  case OP_ADD:
+  case OP_AND:
+    if (instr & 0x20)
+      snprintf(buf, size, "%s R%d, R%d, #%d", names[opcode], r0, r1, (int16_t)sign_extend(instr & 0x1F, 5));
+    else
+      snprintf(buf, size, "%s R%d, R%d, R%d", names[opcode], r0, r1, instr & 0x7);
+    break;
+  case OP_NOT:
+    snprintf(buf, size, "NOT R%d, R%d", r0, r1);
+    break;
+  case OP_BR:
+    if ((instr & 0x0E00) == 0)
+      snprintf(buf, size, "NOP");
+    else
+      snprintf(buf, size, "BR%s%s%s x%04X", (instr & 0x0800) ? "n" : "", (instr & 0x0400) ? "z" : "",
+               (instr & 0x0200) ? "p" : "", (uint16_t)(next + sign_extend(instr & 0x1FF, 9)));
+    break;
+  case OP_JMP:
+    if (r1 == R_R7)
+      snprintf(buf, size, "RET");
+    else
+      snprintf(buf, size, "JMP R%d", r1);
+    break;
+  case OP_JSR:
+    if (instr & 0x0800)
+      snprintf(buf, size, "JSR x%04X", (uint16_t)(next + sign_extend(instr & 0x7FF, 11)));
+    else
+      snprintf(buf, size, "JSRR R%d", r1);
+    break;
+  case OP_LD:
+  case OP_LDI:
+  case OP_LEA:
+  case OP_ST:
+  case OP_STI:
+    snprintf(buf, size, "%s R%d, x%04X", names[opcode], r0, (uint16_t)(next + sign_extend(instr & 0x1FF, 9)));
+    break;
+  case OP_LDR:
+  case OP_STR:
+    snprintf(buf, size, "%s R%d, R%d, #%d", names[opcode], r0, r1, (int16_t)sign_extend(instr & 0x3F, 6));
+    break;
+  case OP_TRAP:
+    if (trap_name(instr & 0xFF))
+      snprintf(buf, size, "%s", trap_name(instr & 0xFF));
+    else
+      snprintf(buf, size, "TRAP x%02X", instr & 0xFF);
+    break;
+  default:
+    snprintf(buf, size, "%s", names[opcode]);
+    break;
+  }
+}
+
+static void print_location()
+{
+  char text[32];
+  uint16_t pc = reg[R_PC];
+  disassemble(pc, memory[pc], text, sizeof(text));
+  printf("[%llu] x%04X: x%04X  %s\n", (unsigned long long)icount, pc, memory[pc], text);
+}
+
+static void print_registers()
+{
+  for (int r = R_R0; r <= R_R7; ++r)
+  {
+    printf("R%d x%04X %6d%s", r, reg[r], (int16_t)reg[r], (r % 4 == 3) ? "\n" : "   ");
+  }
+  printf("PC x%04X   COND %s%s%s   icount %llu\n", reg[R_PC], (reg[R_COND] & FL_NEG) ? "n" : "",
+         (reg[R_COND] & FL_ZRO) ? "z" : "", (reg[R_COND] & FL_POS) ? "p" : "", (unsigned long long)icount);
+}
+
+static void print_stop(int reason)
+{
+  switch (reason)
+  {
+  case STOP_BREAK:
+    printf("Breakpoint at x%04X\n", reg[R_PC]);
+    break;
+  case STOP_HALT:
+    printf("Program halted\n");
+    break;
+  case STOP_INTERRUPT:
+    printf("Interrupted\n");
+    break;
+  case STOP_HISTORY:
+    printf("Reached the start of recorded history\n");
+    break;
+  case STOP_WATCH:
+    if (watch_hit.kind & WATCH_READ)
+      printf("Watchpoint %d: read x%04X = x%04X\n", watch_hit.id, watch_hit.address, watch_hit.new_value);
+    else
+      printf("Watchpoint %d: write x%04X x%04X -> x%04X\n", watch_hit.id, watch_hit.address, watch_hit.old_value,
+             watch_hit.new_value);
+    break;
+  }
+  print_location();
+}
+
+static int parse_number(const char *s, uint64_t *out)
+{
+  char *end;
+  if (!s)
+  {
+    return 0;
+  }
+  if (s[0] == 'x' || s[0] == 'X')
+  {
+    *out = strtoull(s + 1, &end, 16);
+  }
+  else if (s[0] == '#')
+  {
+    *out = strtoull(s + 1, &end, 10);
+  }
+  else
+  {
+    *out = strtoull(s, &end, 0);
+  }
+  return *s && *end == '\0';
+}
+
+static void print_help()
+{
+  printf("step [N]        (s)   execute N instructions\n");
+  printf("continue        (c)   run until a breakpoint or HALT\n");
+  printf("rstep [N]       (rs)  step N instructions backwards\n");
+  printf("rcontinue       (rc)  run backwards to the previous breakpoint\n");
+  printf("break ADDR [if EXPR] (b) set a breakpoint, optionally conditional\n");
+  printf("cond ADDR [EXPR]      change or clear a breakpoint's condition\n");
+  printf("delete ADDR     (d)   remove a breakpoint\n");
+  printf("watch A [B]            stop after writes to A..B\n");
+  printf("rwatch A [B]           stop after reads from A..B\n");
+  printf("cwatch A [B]           stop after writes that change A..B\n");
+  printf("unwatch N              remove watchpoint N\n");
+  printf("info            (i)   list breakpoints, watchpoints and checkpoints\n");
+  printf("regs            (r)   show registers\n");
+  printf("x ADDR [N]            dump N words of memory\n");
+  printf("quit            (q)   exit\n");
+}
+
+static int is_command(const char *word, const char *name, const char *alias)
+{
+  return !strcmp(word, name) || (alias && !strcmp(word, alias));
+}
+
+// The guest runs with the terminal in raw mode, the prompt in cooked mode
+static void begin_run()
+{
+  debug_interrupted = 0;
+  disable_input_buffering();
+}
+
+static void end_run(int reason)
+{
+  restore_input_buffering();
+  print_stop(reason);
+}
+
+void debug_main()
+{
+  char line[256];
+  char last[256] = "";
+
+  restore_input_buffering();
+  print_location();
+  for (;;)
+  {
+    printf("(lc3db) ");
+    fflush(stdout);
+    if (!fgets(line, sizeof(line), stdin))
+    {
+      break;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0')
+    {
+      // An empty line repeats the previous command, like gdb
+      strcpy(line, last);
+    }
+    strcpy(last, line);
+
+    // Conditions run to the end of the line: "break ADDR if EXPR" and "cond ADDR EXPR"
+    char *condition = strstr(line, " if ");
+    if (condition)
+    {
+      condition += 4;
+    }
+    else if (!strncmp(line, "cond ", 5))
+    {
+      condition = line + 5 + strspn(line + 5, " \t");
+      condition += strcspn(condition, " \t");
+      condition += strspn(condition, " \t");
+    }
+    if (condition)
+    {
+      // Keep the expression out of strtok's way
+      static char text[256];
+      strcpy(text, condition);
+      condition[0] = '\0';
+      condition = text;
+    }
+
+    char *cmd = strtok(line, " \t");
+    char *arg1 = strtok(NULL, " \t");
+    char *arg2 = strtok(NULL, " \t");
+    uint64_t n = 1;
+    uint64_t addr;
+
+    if (!cmd)
+    {
+      continue;
+    }
+    if (is_command(cmd, "step", "s") || is_command(cmd, "stepi", "si"))
+    {
+      if (arg1 && !parse_number(arg1, &n))
+      {
+        printf("bad count: %s\n", arg1);
+        continue;
+      }
+      begin_run();
+      end_run(debug_step(n));
+    }
+    else if (is_command(cmd, "continue", "c"))
+    {
+      begin_run();
+      end_run(debug_continue());
+    }
+    else if (is_command(cmd, "rstep", "rs"))
+    {
+      if (arg1 && !parse_number(arg1, &n))
+      {
+        printf("bad count: %s\n", arg1);
+        continue;
+      }
+      begin_run();
+      end_run(debug_reverse_step(n));
+    }
+    else if (is_command(cmd, "rcontinue", "rc"))
+    {
+      begin_run();
+      end_run(debug_reverse_continue());
+    }
+    else if (is_command(cmd, "break", "b") || is_command(cmd, "delete", "d"))
+    {
+      char error[80];
+      if (!parse_number(arg1, &addr) || addr >= MEMORY_MAX || (arg2 && (strcmp(arg2, "if") || !condition)))
+      {
+        printf("usage: %s ADDR%s\n", cmd, cmd[0] == 'b' ? " [if CONDITION]" : "");
+      }
+      else if (cmd[0] == 'b')
+      {
+        int added = debug_break_add(addr);
+        if (condition && !debug_break_condition(addr, condition, error, sizeof(error)))
+        {
+          printf("bad condition: %s\n", error);
+          if (added)
+          {
+            debug_break_remove(addr);
+          }
+          continue;
+        }
+        printf(added ? "Breakpoint set at x%04X\n" : "Breakpoint updated at x%04X\n", (uint16_t)addr);
+      }
+      else
+      {
+        printf(debug_break_remove(addr) ? "Deleted breakpoint at x%04X\n" : "No breakpoint at x%04X\n",
+               (uint16_t)addr);
+      }
+    }
+    else if (is_command(cmd, "cond", NULL))
+    {
+      char error[80];
+      if (!parse_number(arg1, &addr) || addr >= MEMORY_MAX)
+      {
+        printf("usage: cond ADDR [CONDITION]\n");
+      }
+      else if (!debug_break_condition(addr, condition, error, sizeof(error)))
+      {
+        printf("%s\n", error);
+      }
+    }
+    else if (is_command(cmd, "watch", NULL) || is_command(cmd, "rwatch", NULL) || is_command(cmd, "cwatch", NULL))
+    {
+      uint64_t end;
+      int kind = cmd[0] == 'r' ? WATCH_READ : cmd[0] == 'c' ? WATCH_CHANGE : WATCH_WRITE;
+      if (!parse_number(arg1, &addr) || addr >= MEMORY_MAX)
+      {
+        printf("usage: %s START [END]\n", cmd);
+        continue;
+      }
+      end = addr;
+      if (arg2 && (!parse_number(arg2, &end) || end >= MEMORY_MAX))
+      {
+        printf("usage: %s START [END]\n", cmd);
+        continue;
+      }
+      int id = debug_watch_add(addr, end, kind);
+      if (id < 0)
+        printf("cannot add watchpoint\n");
+      else
+        printf("Watchpoint %d on x%04X..x%04X\n", id, (uint16_t)addr, (uint16_t)end);
+    }
+    else if (is_command(cmd, "unwatch", NULL))
+    {
+      if (!parse_number(arg1, &n) || !debug_watch_remove((int)n))
+      {
+        printf("no such watchpoint\n");
+      }
+      else
+      {
+        printf("Deleted watchpoint %d\n", (int)n);
+      }
+    }
+    else if (is_command(cmd, "info", "i"))
+    {
+      for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+      {
+        if (breakpoints[a] && condition_text[a])
+        {
+          printf("breakpoint x%04X if %s\n", a, condition_text[a]);
+        }
+        else if (breakpoints[a])
+        {
+          printf("breakpoint x%04X\n", a);
+        }
+      }
+      for (int id = 0; id < WATCH_MAX; ++id)
+      {
+        struct watchpoint *w = &watchpoints[id];
+        if (w->kind)
+        {
+          printf("watchpoint %d %s x%04X..x%04X\n", id,
+                 w->kind == WATCH_READ ? "read" : w->kind == WATCH_CHANGE ? "change" : "write", w->start, w->end);
+        }
+      }
+      printf("%zu checkpoints, every %llu instructions, oldest at %llu\n", checkpoint_count,
+             (unsigned long long)checkpoint_interval, (unsigned long long)checkpoints[0].icount);
+    }
+    else if (is_command(cmd, "regs", "r"))
+    {
+      print_registers();
+    }
+    else if (is_command(cmd, "x", NULL))
+    {
+      n = 8;
+      if (!parse_number(arg1, &addr) || (arg2 && !parse_number(arg2, &n)))
+      {
+        printf("usage: x ADDR [N]\n");
+        continue;
+      }
+      for (uint64_t i = 0; i < n; ++i)
+      {
+        uint16_t a = (uint16_t)(addr + i);
+        char text[32];
+        disassemble(a, memory[a], text, sizeof(text));
+        printf("x%04X: x%04X  %s\n", a, memory[a], text);
+      }
+    }
+    else if (is_command(cmd, "help", "h"))
+    {
+      print_help();
+    }
+    else if (is_command(cmd, "quit", "q"))
+    {
+      break;
+    }
+    else
+    {
+      printf("unknown command: %s (try help)\n", cmd);
+    }
+  }
+  disable_input_buffering();
+}
@@ -0,0 +1,87 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Instructions between two checkpoints unless --checkpoint-interval says otherwise
+#define DEBUG_CHECKPOINT_INTERVAL 1000000
+
+// Why the debugger handed control back
+enum
+{
+  STOP_STEP = 0,  // Ran the requested number of instructions
+  STOP_BREAK,     // Reached a breakpoint
+  STOP_HALT,      // Guest executed TRAP_HALT
+  STOP_INTERRUPT, // Ctrl-C
+  STOP_HISTORY,   // Reverse execution reached the oldest checkpoint
+  STOP_WATCH,     // An access matched a watchpoint, the instruction completed
+};
+
+// Watchpoint kinds
+enum
+{
+  WATCH_READ = 1 << 0,
+  WATCH_WRITE = 1 << 1,
+  WATCH_CHANGE = 1 << 2, // Writes that store a different value
+};
+
+// The access that triggered the last STOP_WATCH
+struct watch_hit
+{
+  int id;
+  int kind;
+  uint16_t address;
+  uint16_t old_value;
+  uint16_t new_value;
+};
+
+extern int debug_enabled;
+extern volatile sig_atomic_t debug_interrupted;
+extern struct watch_hit watch_hit;
+
+// Called between slices of a run, a nonzero return interrupts it
+extern int (*debug_poll)(void);
+
+void debug_init(uint64_t checkpoint_interval);
+void debug_main(void);
+
+// Drop breakpoints, watchpoints and history and let the guest run on freely
+void debug_detach(void);
+
+// Hooks for the VM core: input is logged so that replay is deterministic,
+// output is muted while re-executing history and writes save page pre-images
+int debug_input(int (*source)(void));
+int debug_replaying(void);
+void debug_track_write(uint16_t address);
+void debug_watch_read(uint16_t address);
+void debug_watch_write(uint16_t address, uint16_t value);
+
+// Change guest state while stopped. The recorded history restarts at the
+// current instruction since it no longer leads here.
+void debug_poke_memory(uint16_t address, uint16_t value);
+void debug_poke_register(int r, uint16_t value);
+
+// Execution control, each returns one of the STOP_* reasons
+int debug_step(uint64_t count);
+int debug_continue(void);
+int debug_reverse_step(uint64_t count);
+int debug_reverse_continue(void);
+
+// Breakpoints, return 0 if there was nothing to add or remove
+int debug_break_add(uint16_t address);
+int debug_break_remove(uint16_t address);
+
+// Attach a condition like "R0 == x41 && mem[x4000] > 3" to an existing
+// breakpoint, or clear it with NULL. It is compiled once to predicate
+// bytecode that only runs when the breakpoint's address is reached.
+int debug_break_condition(uint16_t address, const char *text, char *error, size_t error_size);
+
+// Watchpoints on the inclusive range start..end. Only the pages they cover
+// leave the memory fast path. Add returns the watchpoint number or -1.
+int debug_watch_add(uint16_t start, uint16_t end, int kind);
+int debug_watch_find(uint16_t start, uint16_t end, int kind);
+int debug_watch_remove(int id);
+
+#endif
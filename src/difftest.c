@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "lc3.h"
+#include "stats.h"
+#include "tier.h"
+#include "difftest.h"
+
+// Where exhaustive mode puts the instruction under test, followed by HALT so
+// that it makes a block of its own
+#define TEST_PC 0x3000
+
+struct engine
+{
+  const char *name;
+  uint32_t predecode_after;
+  uint32_t jit_after;
+  uint32_t trace_after;
+  uint32_t cgen_after;
+};
+
+static const struct engine engines[] = {
+    {"interp", 0, 0, 0, 0}, {"predecode", 1, 0, 0, 0}, {"jit", 1, 1, 0, 0},
+    {"trace", 1, 1, 1, 0},  {"cgen", 1, 1, 1, 1},
+};
+
+enum
+{
+  CMD_PROBE, // Fork a probe that runs to the target and reports
+  CMD_KEEP,  // The probe replaces the process it was forked from
+  CMD_DROP,  // The probe exits
+  CMD_DUMP,  // Send all of memory
+  CMD_QUIT,
+};
+
+struct command
+{
+  uint32_t op;
+  uint32_t reserved;
+  uint64_t target;
+};
+
+struct state
+{
+  uint64_t icount;
+  uint64_t memory_hash;
+  uint64_t bytes_out;
+  uint16_t reg[R_COUNT];
+  uint16_t instr; // At PC
+  uint16_t running;
+};
+
+// One instruction word from one starting state, in exhaustive mode
+struct result
+{
+  uint16_t instr;
+  uint16_t before[R_COUNT];
+  uint32_t index;
+  struct state after;
+};
+
+struct side
+{
+  const struct engine *engine;
+  pid_t pid;
+  int command;
+  int reply;
+};
+
+int difftest_enabled;
+
+static uint8_t *script;
+static size_t script_size;
+static size_t script_pos;
+
+int difftest_key_ready()
+{
+  return script_pos < script_size;
+}
+
+int difftest_getc()
+{
+  return script_pos < script_size ? script[script_pos++] : EOF;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+  while (size > 0)
+  {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0)
+    {
+      return 0;
+    }
+    p += n;
+    size -= (size_t)n;
+  }
+  return 1;
+}
+
+static int read_all(int fd, void *data, size_t size)
+{
+  uint8_t *p = data;
+  while (size > 0)
+  {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0)
+    {
+      return 0;
+    }
+    p += n;
+    size -= (size_t)n;
+  }
+  return 1;
+}
+
+static uint64_t memory_hash()
+{
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t i = 0; i < MEMORY_MAX; i += 4)
+  {
+    uint64_t words;
+    memcpy(&words, memory + i, sizeof(words));
+    hash = (hash ^ words) * 0x100000001B3;
+  }
+  return hash;
+}
+
+static void capture_state(struct state *s)
+{
+  memset(s, 0, sizeof(*s));
+  s->icount = icount;
+  s->memory_hash = memory_hash();
+  s->bytes_out = counters.bytes_out;
+  memcpy(s->reg, reg, sizeof(s->reg));
+  s->instr = memory[reg[R_PC]];
+  s->running = (uint16_t)running;
+}
+
+static void run_to(uint64_t target)
+{
+  while (running && icount < target)
+  {
+    tier_run(target);
+  }
+}
+
+// An engine process. The process reading commands holds the last state both
+// engines agreed on, a probe it forks takes over or exits.
+static void serve(int command, int reply)
+{
+  struct command c;
+  while (read_all(command, &c, sizeof(c)))
+  {
+    if (c.op == CMD_PROBE)
+    {
+      int sync[2];
+      if (pipe(sync) != 0)
+      {
+        _exit(1);
+      }
+      pid_t probe = fork();
+      if (probe < 0)
+      {
+        _exit(1);
+      }
+      if (probe == 0)
+      {
+        close(sync[0]);
+        run_to(c.target);
+        struct state s;
+        capture_state(&s);
+        write_all(reply, &s, sizeof(s));
+        while (read_all(command, &c, sizeof(c)) && c.op == CMD_DUMP)
+        {
+          write_all(reply, memory, sizeof(memory));
+        }
+        if (c.op != CMD_KEEP)
+        {
+          _exit(0);
+        }
+        // Let the process this was forked from go
+        write_all(sync[1], "K", 1);
+        close(sync[1]);
+        continue;
+      }
+      close(sync[1]);
+      char kept;
+      int n = (int)read(sync[0], &kept, 1);
+      close(sync[0]);
+      if (n == 1)
+      {
+        _exit(0);
+      }
+      waitpid(probe, NULL, 0);
+    }
+    else if (c.op == CMD_QUIT)
+    {
+      break;
+    }
+  }
+  _exit(0);
+}
+
+static uint64_t rng;
+
+static uint64_t next_random()
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 0x2545F4914F6CDD1D;
+}
+
+// Exhaustive mode in an engine process: every word from the same sequence of
+// random states in both engines
+static void serve_exhaustive(const struct difftest_options *options, int reply)
+{
+  rng = options->seed ? options->seed : 1;
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    memory[a] = (a >> PAGE_SHIFT) == (MR_KBSR >> PAGE_SHIFT) ? 0 : (uint16_t)next_random();
+  }
+  uint32_t index = 0;
+  for (uint32_t instr = 0; instr < MEMORY_MAX; ++instr)
+  {
+    uint16_t op = instr >> 12;
+    if (op == OP_RTI || op == OP_RES)
+    {
+      continue;
+    }
+    for (uint32_t k = 0; k < options->states; ++k)
+    {
+      struct result r;
+      memset(&r, 0, sizeof(r));
+      r.instr = (uint16_t)instr;
+      r.index = index++;
+      // Through the store path, so generated code for the last word goes
+      mem_write(TEST_PC, (uint16_t)instr);
+      mem_write(TEST_PC + 1, 0xF000 | TRAP_HALT);
+      for (int g = 0; g < 8; ++g)
+      {
+        reg[g] = (uint16_t)next_random();
+      }
+      reg[R_COND] = 1 << (next_random() % 3);
+      reg[R_PC] = TEST_PC;
+      running = 1;
+      memcpy(r.before, reg, sizeof(r.before));
+      run_to(icount + 1);
+      capture_state(&r.after);
+      if (!write_all(reply, &r, sizeof(r)))
+      {
+        _exit(1);
+      }
+    }
+  }
+  _exit(0);
+}
+
+static const struct engine *find_engine(const char *name, size_t length)
+{
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+  {
+    if (strlen(engines[i].name) == length && !strncmp(engines[i].name, name, length))
+    {
+      return &engines[i];
+    }
+  }
+  return NULL;
+}
+
+static int start(struct side *side, const struct difftest_options *options)
+{
+  int command[2], reply[2];
+  if (pipe(command) != 0 || pipe(reply) != 0)
+  {
+    return 0;
+  }
+  fflush(stdout);
+  side->pid = fork();
+  if (side->pid < 0)
+  {
+    return 0;
+  }
+  if (side->pid == 0)
+  {
+    close(command[1]);
+    close(reply[0]);
+    // The guest's console goes nowhere, output is only counted
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    const struct engine *e = side->engine;
+    tier_init(e->predecode_after, e->jit_after, e->trace_after, e->cgen_after, 0);
+    if (options->exhaustive)
+    {
+      serve_exhaustive(options, reply[1]);
+    }
+    serve(command[0], reply[1]);
+  }
+  close(command[0]);
+  close(reply[1]);
+  side->command = command[1];
+  side->reply = reply[0];
+  return 1;
+}
+
+static int send(struct side *side, uint32_t op, uint64_t target)
+{
+  struct command c = {.op = op, .target = target};
+  return write_all(side->command, &c, sizeof(c));
+}
+
+static void print_regs(const char *title, const uint16_t *r)
+{
+  printf("%-10s", title);
+  for (int g = 0; g < 8; ++g)
+  {
+    printf(" R%d=x%04X", g, r[g]);
+  }
+  printf(" PC=x%04X COND=%d\n", r[R_PC], r[R_COND]);
+}
+
+static void print_state(const struct side *side, const struct state *s)
+{
+  print_regs(side->engine->name, s->reg);
+  printf("%-10s icount=%llu running=%d output=%llu memory=%016llx\n", "", (unsigned long long)s->icount,
+         s->running, (unsigned long long)s->bytes_out, (unsigned long long)s->memory_hash);
+}
+
+// Memory of both probes at the last mismatch, taken before they are dropped
+static uint16_t memory_a[MEMORY_MAX];
+static uint16_t memory_b[MEMORY_MAX];
+
+static int dump(struct side *side, uint16_t *out)
+{
+  return send(side, CMD_DUMP, 0) && read_all(side->reply, out, sizeof(memory_a));
+}
+
+static void print_memory_diff(const struct side *a, const struct side *b)
+{
+  int shown = 0;
+  for (uint32_t address = 0; address < MEMORY_MAX && shown < 8; ++address)
+  {
+    if (memory_a[address] != memory_b[address])
+    {
+      printf("  mem[x%04X]: %s x%04X, %s x%04X\n", address, a->engine->name, memory_a[address], b->engine->name,
+             memory_b[address]);
+      ++shown;
+    }
+  }
+}
+
+static int compare_run(struct side *a, struct side *b, const struct difftest_options *options)
+{
+  struct state good, sa, sb, bad_a, bad_b;
+  memset(&good, 0, sizeof(good));
+  int have_good = 0;
+  uint64_t bad = 0; // Where the engines were last seen to differ
+  uint64_t bad_from = 0; // The start of that run
+  for (;;)
+  {
+    uint64_t target;
+    if (!have_good)
+    {
+      target = 0;
+    }
+    else if (bad)
+    {
+      // Only ever strictly inside the range. How compiled code runs depends
+      // on how far it may go at once, so the end of the range probed again
+      // from a later start need not differ any more.
+      target = good.icount + (bad - good.icount) / 2;
+    }
+    else
+    {
+      target = good.icount + options->every;
+      if (options->max && target > options->max)
+      {
+        target = options->max;
+      }
+    }
+    if (bad && bad - good.icount <= 1)
+    {
+      if (bad_from == good.icount)
+      {
+        printf("%s and %s differ after instruction %llu, x%04X at x%04X\n", a->engine->name, b->engine->name,
+               (unsigned long long)bad, good.instr, good.reg[R_PC]);
+        print_regs("before", good.reg);
+      }
+      else
+      {
+        printf("%s and %s differ at instruction %llu when run from %llu, but not when stopped at %llu\n",
+               a->engine->name, b->engine->name, (unsigned long long)bad, (unsigned long long)bad_from,
+               (unsigned long long)good.icount);
+      }
+      print_state(a, &bad_a);
+      print_state(b, &bad_b);
+      print_memory_diff(a, b);
+      return 1;
+    }
+    if (!send(a, CMD_PROBE, target) || !send(b, CMD_PROBE, target) || !read_all(a->reply, &sa, sizeof(sa)) ||
+        !read_all(b->reply, &sb, sizeof(sb)))
+    {
+      printf("an engine process died before instruction %llu\n", (unsigned long long)target);
+      return 1;
+    }
+
+    if (!memcmp(&sa, &sb, sizeof(sa)))
+    {
+      send(a, CMD_KEEP, 0);
+      send(b, CMD_KEEP, 0);
+      good = sa;
+      have_good = 1;
+      if (!sa.running || (options->max && sa.icount >= options->max))
+      {
+        printf("%s and %s agree over %llu instructions\n", a->engine->name, b->engine->name,
+               (unsigned long long)sa.icount);
+        return 0;
+      }
+      continue;
+    }
+    if (!have_good)
+    {
+      printf("%s and %s differ before the first instruction\n", a->engine->name, b->engine->name);
+      return 1;
+    }
+    bad = target;
+    bad_from = good.icount;
+    bad_a = sa;
+    bad_b = sb;
+    if (!dump(a, memory_a) || !dump(b, memory_b))
+    {
+      printf("an engine process died at instruction %llu\n", (unsigned long long)target);
+      return 1;
+    }
+    send(a, CMD_DROP, 0);
+    send(b, CMD_DROP, 0);
+  }
+}
+
+static int compare_exhaustive(struct side *a, struct side *b)
+{
+  struct result ra, rb;
+  uint32_t tests = 0;
+  for (;;)
+  {
+    int got_a = read_all(a->reply, &ra, sizeof(ra));
+    int got_b = read_all(b->reply, &rb, sizeof(rb));
+    if (!got_a && !got_b)
+    {
+      printf("%s and %s agree on %u tests\n", a->engine->name, b->engine->name, tests);
+      return 0;
+    }
+    if (!got_a || !got_b)
+    {
+      printf("an engine process died after %u tests\n", tests);
+      return 1;
+    }
+    if (memcmp(&ra, &rb, sizeof(ra)))
+    {
+      printf("%s and %s differ on x%04X in test %u\n", a->engine->name, b->engine->name, ra.instr, ra.index);
+      print_regs("before", ra.before);
+      print_state(a, &ra.after);
+      print_state(b, &rb.after);
+      return 1;
+    }
+    ++tests;
+  }
+}
+
+int difftest_main(const struct difftest_options *options)
+{
+  const char *comma = options->engines ? strchr(options->engines, ',') : NULL;
+  struct side a = {0}, b = {0};
+  if (comma)
+  {
+    a.engine = find_engine(options->engines, (size_t)(comma - options->engines));
+    b.engine = find_engine(comma + 1, strlen(comma + 1));
+  }
+  if (!a.engine || !b.engine)
+  {
+    printf("--diff takes two of interp, predecode, jit, trace and cgen, like jit,interp\n");
+    return 2;
+  }
+  if (options->input)
+  {
+    FILE *file = fopen(options->input, "rb");
+    if (!file)
+    {
+      printf("failed to open the input script: %s\n", options->input);
+      return 2;
+    }
+    size_t capacity = 0;
+    for (;;)
+    {
+      if (script_size == capacity)
+      {
+        capacity = capacity ? capacity * 2 : 4096;
+        script = realloc(script, capacity);
+        if (!script)
+        {
+          fclose(file);
+          return 2;
+        }
+      }
+      size_t n = fread(script + script_size, 1, capacity - script_size, file);
+      if (n == 0)
+      {
+        break;
+      }
+      script_size += n;
+    }
+    fclose(file);
+  }
+  difftest_enabled = 1;
+  reg[R_COND] = FL_ZRO;
+  reg[R_PC] = PC_START;
+
+  // A probe that exits early must not take the controller with it
+  signal(SIGPIPE, SIG_IGN);
+  if (!start(&a, options) || !start(&b, options))
+  {
+    printf("failed to start the engine processes\n");
+    return 2;
+  }
+  int status = options->exhaustive ? compare_exhaustive(&a, &b) : compare_run(&a, &b, options);
+  kill(a.pid, SIGKILL);
+  kill(b.pid, SIGKILL);
+  // Probes and the processes they replaced are not children of this one
+  signal(SIGCHLD, SIG_IGN);
+  close(a.command);
+  close(b.command);
+  return status;
+}
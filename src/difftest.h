@@ -0,0 +1,40 @@
+#ifndef DIFFTEST_H
+#define DIFFTEST_H
+
+#include <stdint.h>
+
+// Default instructions between comparisons, and random register states per
+// instruction word in exhaustive mode
+#define DIFFTEST_EVERY 1000000
+#define DIFFTEST_STATES 4
+
+struct difftest_options
+{
+  const char *engines; // "A,B" out of interp, predecode, jit, trace and cgen
+  uint64_t every;
+  uint64_t max;      // Stop comparing after this many instructions, 0 never
+  const char *input; // Keyboard input for both engines, NULL for none
+  int exhaustive;
+  uint32_t states;
+  uint64_t seed;
+};
+
+// Run the loaded image in two engines, each in a process of its own with
+// the same scripted keyboard, and compare registers, PC, COND, a hash of
+// memory and the output byte count every so many instructions. Before each
+// comparison an engine forks a probe that runs ahead; the probe replaces it
+// when both agree and is dropped otherwise, so a mismatch is bisected down
+// to the first instruction after which the engines differ.
+// In exhaustive mode every instruction word except RTI and the reserved
+// opcode, which abort in all engines, is run on its own from random
+// register states and random memory instead.
+// Returns the exit status: 0 when the engines agree, 1 when they do not.
+int difftest_main(const struct difftest_options *options);
+
+// Keyboard input comes from the script in the engine processes. Once it
+// runs out, no key is ever ready and reads return EOF.
+extern int difftest_enabled;
+int difftest_key_ready(void);
+int difftest_getc(void);
+
+#endif
@@ -0,0 +1,741 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lc3.h"
+#include "debugger.h"
+#include "gdbstub.h"
+
+// Largest packet we accept. Big enough for gdb to move the whole 128 KiB
+// address space in a handful of m/X packets.
+#define PACKET_SIZE 0x20000
+
+// Register numbers in the target description
+enum
+{
+  GDB_PC = 8,
+  GDB_PSR,
+  GDB_REG_COUNT
+};
+
+// LC-3 memory is word addressed while gdb counts bytes, so byte address A is
+// the low (A even) or high (A odd) half of word A / 2. The pointer registers
+// are shown as byte addresses too, which takes 17 bits.
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+    "<target version=\"1.0\">\n"
+    "  <feature name=\"org.lc3.core\">\n"
+    "    <reg name=\"r0\" bitsize=\"16\" type=\"int16\" regnum=\"0\"/>\n"
+    "    <reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>\n"
+    "    <reg name=\"r2\" bitsize=\"16\" type=\"int16\"/>\n"
+    "    <reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>\n"
+    "    <reg name=\"r4\" bitsize=\"16\" type=\"int16\"/>\n"
+    "    <reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>\n"
+    "    <reg name=\"r6\" bitsize=\"32\" type=\"data_ptr\"/>\n"
+    "    <reg name=\"r7\" bitsize=\"32\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"psr\" bitsize=\"16\" type=\"int16\"/>\n"
+    "  </feature>\n"
+    "</target>\n";
+
+static int conn = -1;
+static int no_ack;
+
+static uint8_t in_buf[4096];
+static size_t in_len;
+static size_t in_pos;
+
+static char *packet;
+static char *reply;
+static size_t reply_len;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Connection
+static int listen_on(const char *where)
+{
+  int fd;
+  if (where[0] == ':')
+  {
+    struct sockaddr_in addr = {0};
+    int one = 1;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(where + 1));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  else
+  {
+    struct sockaddr_un addr = {0};
+    if (strlen(where) >= sizeof(addr.sun_path))
+    {
+      return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, where);
+    unlink(where);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+      return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, 1) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int get_byte()
+{
+  if (in_pos == in_len)
+  {
+    ssize_t n = recv(conn, in_buf, sizeof(in_buf), 0);
+    if (n <= 0)
+    {
+      return -1;
+    }
+    in_len = n;
+    in_pos = 0;
+  }
+  return in_buf[in_pos++];
+}
+
+static void send_all(const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = send(conn, data, len, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+// Ctrl-C from gdb arrives as a lone 0x03 while the guest runs
+static int poll_interrupt()
+{
+  struct pollfd pfd = {conn, POLLIN, 0};
+  if (in_pos < in_len || poll(&pfd, 1, 0) <= 0)
+  {
+    return 0;
+  }
+  int c = get_byte();
+  return c == 0x03 || c < 0;
+}
+
+// Packets
+static int hex_value(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Read one packet into packet[], returns its length or -1 on disconnect
+static int read_packet()
+{
+  for (;;)
+  {
+    int c;
+    do
+    {
+      c = get_byte();
+      if (c < 0)
+      {
+        return -1;
+      }
+    } while (c != '$');
+
+    size_t len = 0;
+    uint8_t sum = 0;
+    while ((c = get_byte()) != '#')
+    {
+      if (c < 0)
+      {
+        return -1;
+      }
+      if (len < PACKET_SIZE)
+      {
+        packet[len++] = (char)c;
+      }
+      sum += (uint8_t)c;
+    }
+    int hi = hex_value(get_byte());
+    int lo = hex_value(get_byte());
+    packet[len] = '\0';
+    if (no_ack)
+    {
+      return (int)len;
+    }
+    if (hi >= 0 && lo >= 0 && ((hi << 4) | lo) == sum)
+    {
+      send_all("+", 1);
+      return (int)len;
+    }
+    send_all("-", 1);
+  }
+}
+
+static void reply_char(char c)
+{
+  reply[reply_len++] = c;
+}
+
+static void reply_str(const char *s)
+{
+  while (*s)
+  {
+    reply_char(*s++);
+  }
+}
+
+static void reply_hex8(uint8_t v)
+{
+  reply_char(hex_digits[v >> 4]);
+  reply_char(hex_digits[v & 0xF]);
+}
+
+// Registers travel as 16-bit little-endian values
+// Little endian, like everything gdb sends for this target
+static void reply_hex_le(uint32_t v, int bytes)
+{
+  for (int i = 0; i < bytes; ++i)
+  {
+    reply_hex8((v >> (8 * i)) & 0xFF);
+  }
+}
+
+static void send_reply()
+{
+  uint8_t sum = 0;
+  for (size_t i = 1; i < reply_len; ++i)
+  {
+    sum += (uint8_t)reply[i];
+  }
+  reply_char('#');
+  reply_hex8(sum);
+  send_all(reply, reply_len);
+  reply_len = 1;
+}
+
+static int parse_hex(const char **p, uint64_t *out)
+{
+  const char *s = *p;
+  uint64_t v = 0;
+  while (hex_value(*s) >= 0)
+  {
+    v = (v << 4) | hex_value(*s++);
+  }
+  if (s == *p)
+  {
+    return 0;
+  }
+  *out = v;
+  *p = s;
+  return 1;
+}
+
+// Decode a little endian value of the given size, returns 0 on a bad digit
+static int parse_hex_le(const char *p, int bytes, uint32_t *out)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 2 * bytes; ++i)
+  {
+    int digit = hex_value(p[i]);
+    if (digit < 0)
+    {
+      return 0;
+    }
+    v |= (uint32_t)digit << ((i ^ 1) * 4);
+  }
+  *out = v;
+  return 1;
+}
+
+// Guest state
+static int is_pointer(int r)
+{
+  return r == R_R6 || r == R_R7 || r == GDB_PC;
+}
+
+static int register_bytes(int r)
+{
+  return is_pointer(r) ? 4 : 2;
+}
+
+static uint32_t read_register(int r)
+{
+  if (r < GDB_PC)
+  {
+    return is_pointer(r) ? reg[r] * 2u : reg[r];
+  }
+  if (r == GDB_PC)
+  {
+    return reg[R_PC] * 2u;
+  }
+  // User mode with the condition codes in the low bits
+  return 0x8000 | reg[R_COND];
+}
+
+static void write_register(int r, uint32_t value)
+{
+  if (is_pointer(r))
+  {
+    value >>= 1;
+  }
+  if (r < GDB_PC)
+  {
+    debug_poke_register(r, (uint16_t)value);
+  }
+  else if (r == GDB_PC)
+  {
+    debug_poke_register(R_PC, (uint16_t)value);
+  }
+  else
+  {
+    debug_poke_register(R_COND, value & (FL_NEG | FL_ZRO | FL_POS));
+  }
+}
+
+static uint8_t read_byte(uint32_t address)
+{
+  uint16_t word = memory[(address >> 1) & 0xFFFF];
+  return (address & 1) ? word >> 8 : word & 0xFF;
+}
+
+static void write_byte(uint32_t address, uint8_t value)
+{
+  uint16_t a = (address >> 1) & 0xFFFF;
+  uint16_t word = memory[a];
+  if (address & 1)
+  {
+    word = (word & 0x00FF) | (value << 8);
+  }
+  else
+  {
+    word = (word & 0xFF00) | value;
+  }
+  debug_poke_memory(a, word);
+}
+
+// Stop replies
+static void reply_stop(int reason)
+{
+  switch (reason)
+  {
+  case STOP_HALT:
+    reply_str("W00");
+    break;
+  case STOP_INTERRUPT:
+    reply_str("S02");
+    break;
+  case STOP_HISTORY:
+    reply_str("T05replaylog:begin;");
+    break;
+  case STOP_WATCH:
+  {
+    char text[48];
+    const char *kind = "watch";
+    if (watch_hit.kind == WATCH_READ)
+    {
+      kind = "rwatch";
+    }
+    snprintf(text, sizeof(text), "T05%s:%x;", kind, watch_hit.address * 2);
+    reply_str(text);
+  }
+  break;
+  default:
+    reply_str("S05");
+    break;
+  }
+}
+
+static int resume(int step)
+{
+  debug_poll = poll_interrupt;
+  int reason = step ? debug_step(1) : debug_continue();
+  debug_poll = NULL;
+  return reason;
+}
+
+// Z1 is treated like Z0 since every breakpoint is already a patched entry
+static void handle_breakpoint(const char *p, int insert)
+{
+  uint64_t type, address, length;
+  if (!parse_hex(&p, &type) || *p++ != ',' || !parse_hex(&p, &address) || *p++ != ',' ||
+      !parse_hex(&p, &length) || address >= 2 * MEMORY_MAX)
+  {
+    reply_str("E01");
+    return;
+  }
+  uint16_t start = address >> 1;
+  uint16_t end = (address + (length ? length : 1) - 1) >> 1;
+  int kinds[5] = {0, 0, WATCH_WRITE, WATCH_READ, WATCH_READ | WATCH_WRITE};
+  if (type <= 1)
+  {
+    if (insert)
+      debug_break_add(start);
+    else
+      debug_break_remove(start);
+    reply_str("OK");
+  }
+  else if (type <= 4)
+  {
+    if (insert)
+    {
+      reply_str(debug_watch_add(start, end, kinds[type]) < 0 ? "E02" : "OK");
+    }
+    else
+    {
+      debug_watch_remove(debug_watch_find(start, end, kinds[type]));
+      reply_str("OK");
+    }
+  }
+}
+
+static void handle_read_memory(const char *p)
+{
+  uint64_t address, length;
+  if (!parse_hex(&p, &address) || *p++ != ',' || !parse_hex(&p, &length))
+  {
+    reply_str("E01");
+    return;
+  }
+  if (length > PACKET_SIZE / 2)
+  {
+    length = PACKET_SIZE / 2;
+  }
+  for (uint64_t i = 0; i < length; ++i)
+  {
+    reply_hex8(read_byte((uint32_t)(address + i)));
+  }
+}
+
+static void handle_write_memory(const char *p, int len, int binary)
+{
+  const char *end = packet + len;
+  uint64_t address, length;
+  if (!parse_hex(&p, &address) || *p++ != ',' || !parse_hex(&p, &length) || *p++ != ':')
+  {
+    reply_str("E01");
+    return;
+  }
+  for (uint64_t i = 0; i < length; ++i)
+  {
+    int value;
+    if (binary)
+    {
+      if (p >= end)
+        break;
+      value = (uint8_t)*p++;
+      if (value == '}' && p < end)
+        value = (uint8_t)*p++ ^ 0x20;
+    }
+    else
+    {
+      if (p + 1 >= end || hex_value(p[0]) < 0 || hex_value(p[1]) < 0)
+        break;
+      value = (hex_value(p[0]) << 4) | hex_value(p[1]);
+      p += 2;
+    }
+    write_byte((uint32_t)(address + i), (uint8_t)value);
+  }
+  reply_str("OK");
+}
+
+static void handle_query(const char *p)
+{
+  if (!strncmp(p, "qSupported", 10))
+  {
+    char text[160];
+    snprintf(text, sizeof(text),
+             "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;ReverseStep+;ReverseContinue+;vContSupported+",
+             PACKET_SIZE);
+    reply_str(text);
+  }
+  else if (!strncmp(p, "qXfer:features:read:target.xml:", 31))
+  {
+    const char *q = p + 31;
+    uint64_t offset, length;
+    if (!parse_hex(&q, &offset) || *q++ != ',' || !parse_hex(&q, &length))
+    {
+      reply_str("E01");
+      return;
+    }
+    size_t total = sizeof(target_xml) - 1;
+    if (offset >= total)
+    {
+      reply_str("l");
+      return;
+    }
+    if (length > total - offset)
+    {
+      length = total - offset;
+    }
+    reply_char(offset + length < total ? 'm' : 'l');
+    for (uint64_t i = 0; i < length; ++i)
+    {
+      char c = target_xml[offset + i];
+      if (c == '$' || c == '#' || c == '}' || c == '*')
+      {
+        reply_char('}');
+        c ^= 0x20;
+      }
+      reply_char(c);
+    }
+  }
+  else if (!strcmp(p, "qAttached"))
+  {
+    reply_str("1");
+  }
+  else if (!strcmp(p, "qC"))
+  {
+    reply_str("QC1");
+  }
+  else if (!strcmp(p, "qfThreadInfo"))
+  {
+    reply_str("m1");
+  }
+  else if (!strcmp(p, "qsThreadInfo"))
+  {
+    reply_str("l");
+  }
+  else if (!strcmp(p, "QStartNoAckMode"))
+  {
+    reply_str("OK");
+    send_reply();
+    no_ack = 1;
+  }
+}
+
+// vCont applies the first action since there is only one thread
+static int handle_vcont(const char *p)
+{
+  if (!strcmp(p, "vCont?"))
+  {
+    reply_str("vCont;c;C;s;S");
+    return 0;
+  }
+  p += 5;
+  if (*p == ';')
+  {
+    ++p;
+  }
+  if (*p == 's' || *p == 'S')
+  {
+    reply_stop(resume(1));
+  }
+  else if (*p == 'c' || *p == 'C')
+  {
+    reply_stop(resume(0));
+  }
+  else
+  {
+    reply_str("E01");
+  }
+  return 1;
+}
+
+void gdbstub_main(const char *where)
+{
+  int server = listen_on(where);
+  if (server < 0)
+  {
+    fprintf(stderr, "gdb: cannot listen on %s\n", where);
+    return;
+  }
+  fprintf(stderr, "Waiting for gdb on %s\n", where);
+  conn = accept(server, NULL, NULL);
+  close(server);
+  if (conn < 0)
+  {
+    return;
+  }
+  if (where[0] == ':')
+  {
+    int one = 1;
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  else
+  {
+    unlink(where);
+  }
+
+  packet = malloc(PACKET_SIZE + 1);
+  reply = malloc(2 * PACKET_SIZE + 8);
+  reply[0] = '$';
+  reply_len = 1;
+
+  int done = 0;
+  while (!done)
+  {
+    int len = read_packet();
+    if (len < 0)
+    {
+      break;
+    }
+    const char *p = packet;
+    uint64_t n;
+
+    switch (p[0])
+    {
+    case '?':
+      reply_stop(running ? STOP_STEP : STOP_HALT);
+      break;
+    case 'g':
+      for (int r = 0; r < GDB_REG_COUNT; ++r)
+      {
+        reply_hex_le(read_register(r), register_bytes(r));
+      }
+      break;
+    case 'G':
+    {
+      // Check the whole packet before changing anything
+      uint32_t values[GDB_REG_COUNT];
+      const char *q = p + 1;
+      int ok = 1;
+      for (int r = 0; r < GDB_REG_COUNT && ok; ++r)
+      {
+        ok = (size_t)(packet + len - q) >= (size_t)register_bytes(r) * 2 &&
+             parse_hex_le(q, register_bytes(r), &values[r]);
+        q += register_bytes(r) * 2;
+      }
+      if (ok && q == packet + len)
+      {
+        for (int r = 0; r < GDB_REG_COUNT; ++r)
+        {
+          write_register(r, values[r]);
+        }
+        reply_str("OK");
+      }
+      else
+      {
+        reply_str("E01");
+      }
+      break;
+    }
+    case 'p':
+      ++p;
+      if (parse_hex(&p, &n) && n < GDB_REG_COUNT && !*p)
+        reply_hex_le(read_register((int)n), register_bytes((int)n));
+      else
+        reply_str("E01");
+      break;
+    case 'P':
+    {
+      ++p;
+      uint32_t v;
+      if (parse_hex(&p, &n) && n < GDB_REG_COUNT && *p++ == '=' && strlen(p) == (size_t)register_bytes((int)n) * 2 &&
+          parse_hex_le(p, register_bytes((int)n), &v))
+      {
+        write_register((int)n, v);
+        reply_str("OK");
+      }
+      else
+      {
+        reply_str("E01");
+      }
+      break;
+    }
+    case 'm':
+      handle_read_memory(p + 1);
+      break;
+    case 'M':
+      handle_write_memory(p + 1, len, 0);
+      break;
+    case 'X':
+      handle_write_memory(p + 1, len, 1);
+      break;
+    case 'Z':
+    case 'z':
+      handle_breakpoint(p + 1, p[0] == 'Z');
+      break;
+    case 'c':
+    case 's':
+      if (p[1])
+      {
+        const char *q = p + 1;
+        if (parse_hex(&q, &n))
+        {
+          debug_poke_register(R_PC, (uint16_t)(n >> 1));
+        }
+      }
+      reply_stop(resume(p[0] == 's'));
+      break;
+    case 'b':
+      if (p[1] == 's')
+        reply_stop(debug_reverse_step(1));
+      else if (p[1] == 'c')
+        reply_stop(debug_reverse_continue());
+      break;
+    case 'v':
+      if (!strncmp(p, "vCont", 5))
+      {
+        handle_vcont(p);
+      }
+      break;
+    case 'q':
+    case 'Q':
+      handle_query(p);
+      break;
+    case 'H':
+      reply_str("OK");
+      break;
+    case 'T':
+      reply_str("OK");
+      break;
+    case 'D':
+      reply_str("OK");
+      send_reply();
+      done = 1;
+      continue;
+    case 'k':
+      running = 0;
+      done = 1;
+      continue;
+    }
+    send_reply();
+    if (!running)
+    {
+      // Let gdb read the exit status, then go
+      done = p[0] == 'c' || p[0] == 's' || p[0] == 'v';
+    }
+  }
+  close(conn);
+  free(packet);
+  free(reply);
+}
@@ -0,0 +1,9 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+// Serve the GDB remote serial protocol on a Unix socket path or, for
+// ":PORT", on a loopback TCP port. Returns when the guest halts, when gdb
+// kills it (running is cleared) or when gdb detaches or disconnects.
+void gdbstub_main(const char *where);
+
+#endif
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "heatmap.h"
+
+#define LINES (MEMORY_MAX / HEATMAP_LINE)
+#define HOTTEST 10
+
+// Reuse distances, in distinct lines touched since the last access to the
+// same line: 0, 1, 2-3, 4-7 and so on up to 512-1023, then first accesses
+enum
+{
+  DISTANCES = 11,
+  COLD = DISTANCES,
+  BUCKETS,
+};
+
+enum
+{
+  FETCH,
+  READ,
+  WRITE,
+  KINDS,
+};
+
+static const char *kind_names[] = {"fetches", "reads", "writes"};
+
+// Lines in the order they were last touched, most recent first. Instruction
+// fetches and data accesses are kept apart, like split caches.
+struct stream
+{
+  uint16_t stack[LINES];
+  uint16_t depth;
+  uint8_t seen[LINES];
+  uint64_t histogram[BUCKETS];
+};
+
+int heatmap_enabled;
+
+static const char *prefix;
+static uint64_t counts[KINDS][MEMORY_MAX];
+static struct stream code, data;
+static int fetching;
+
+static int bucket(uint32_t distance)
+{
+  return distance ? 32 - __builtin_clz(distance) : 0;
+}
+
+static void reuse(struct stream *s, uint16_t address)
+{
+  uint16_t line = address / HEATMAP_LINE;
+  if (s->stack[0] == line && s->depth)
+  {
+    ++s->histogram[0];
+    return;
+  }
+  uint32_t distance;
+  if (!s->seen[line])
+  {
+    s->seen[line] = 1;
+    distance = s->depth++;
+    ++s->histogram[COLD];
+  }
+  else
+  {
+    for (distance = 1; s->stack[distance] != line; ++distance)
+    {
+    }
+    ++s->histogram[bucket(distance)];
+  }
+  memmove(s->stack + 1, s->stack, distance * sizeof(s->stack[0]));
+  s->stack[0] = line;
+}
+
+void heatmap_read(uint16_t address)
+{
+  ++counts[fetching ? FETCH : READ][address];
+  reuse(fetching ? &code : &data, address);
+}
+
+void heatmap_write(uint16_t address)
+{
+  ++counts[WRITE][address];
+  reuse(&data, address);
+}
+
+void heatmap_run(uint64_t limit)
+{
+  while (running && icount < limit)
+  {
+    fetching = 1;
+    uint16_t instr = mem_read(reg[R_PC]++);
+    fetching = 0;
+    ++icount;
+    execute(instr);
+  }
+}
+
+static FILE *create(const char *suffix)
+{
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", prefix, suffix);
+  return fopen(path, "w");
+}
+
+static void write_words()
+{
+  FILE *out = create(".csv");
+  if (!out)
+  {
+    return;
+  }
+  fprintf(out, "address,fetches,reads,writes\n");
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    if (counts[FETCH][a] | counts[READ][a] | counts[WRITE][a])
+    {
+      fprintf(out, "%u,%llu,%llu,%llu\n", a, (unsigned long long)counts[FETCH][a],
+              (unsigned long long)counts[READ][a], (unsigned long long)counts[WRITE][a]);
+    }
+  }
+  fclose(out);
+}
+
+static void line_counts(uint32_t line, uint64_t *out)
+{
+  for (int k = 0; k < KINDS; ++k)
+  {
+    out[k] = 0;
+    for (uint32_t a = line * HEATMAP_LINE; a < (line + 1) * HEATMAP_LINE; ++a)
+    {
+      out[k] += counts[k][a];
+    }
+  }
+}
+
+static void write_lines()
+{
+  FILE *out = create("-lines.csv");
+  if (!out)
+  {
+    return;
+  }
+  fprintf(out, "line,start,fetches,reads,writes\n");
+  for (uint32_t line = 0; line < LINES; ++line)
+  {
+    uint64_t c[KINDS];
+    line_counts(line, c);
+    if (c[FETCH] | c[READ] | c[WRITE])
+    {
+      fprintf(out, "%u,%u,%llu,%llu,%llu\n", line, line * HEATMAP_LINE, (unsigned long long)c[FETCH],
+              (unsigned long long)c[READ], (unsigned long long)c[WRITE]);
+    }
+  }
+  fclose(out);
+}
+
+// log2(n + 1), close enough for shading
+static double log_scale(uint64_t n)
+{
+  ++n;
+  int bits = 63 - __builtin_clzll(n);
+  return bits + (double)(n - (1ull << bits)) / (double)(1ull << bits);
+}
+
+static void write_image()
+{
+  FILE *out = create(".ppm");
+  if (!out)
+  {
+    return;
+  }
+  double top[KINDS] = {0};
+  for (int k = 0; k < KINDS; ++k)
+  {
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+      double v = log_scale(counts[k][a]);
+      top[k] = v > top[k] ? v : top[k];
+    }
+  }
+  // A row per page, a pixel per word
+  fprintf(out, "P6\n%d %d\n255\n", PAGE_SIZE, PAGE_COUNT);
+  static const int channel[KINDS] = {2, 1, 0};
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    uint8_t pixel[3] = {0};
+    for (int k = 0; k < KINDS; ++k)
+    {
+      if (counts[k][a])
+      {
+        // The dimmest accessed word still shows
+        pixel[channel[k]] = (uint8_t)(48 + 207 * log_scale(counts[k][a]) / top[k]);
+      }
+    }
+    fwrite(pixel, 1, sizeof(pixel), out);
+  }
+  fclose(out);
+}
+
+static void touched(uint32_t *words, uint32_t *lines, int from, int to)
+{
+  *words = 0;
+  *lines = 0;
+  for (uint32_t line = 0; line < LINES; ++line)
+  {
+    int any = 0;
+    for (uint32_t a = line * HEATMAP_LINE; a < (line + 1) * HEATMAP_LINE; ++a)
+    {
+      int hit = 0;
+      for (int k = from; k <= to; ++k)
+      {
+        hit |= counts[k][a] != 0;
+      }
+      *words += hit;
+      any |= hit;
+    }
+    *lines += any;
+  }
+}
+
+// Lines an LRU cache of whole lines needs for share of the stream's accesses
+// to hit, as a power of two, or 0 when not even all of memory would do
+static uint32_t capacity(const struct stream *s, double share)
+{
+  uint64_t total = 0;
+  for (int b = 0; b < BUCKETS; ++b)
+  {
+    total += s->histogram[b];
+  }
+  uint64_t hits = 0;
+  for (int b = 0; b < DISTANCES; ++b)
+  {
+    hits += s->histogram[b];
+    if (total && hits >= share * total)
+    {
+      return 1u << b;
+    }
+  }
+  return 0;
+}
+
+static void print_capacity(FILE *out, const char *name, const struct stream *s)
+{
+  fprintf(out, "  %-13s", name);
+  static const double shares[] = {0.9, 0.99};
+  for (int i = 0; i < 2; ++i)
+  {
+    uint32_t lines = capacity(s, shares[i]);
+    if (lines)
+    {
+      fprintf(out, " %8u", lines);
+    }
+    else
+    {
+      fprintf(out, " %8s", "-");
+    }
+  }
+  fprintf(out, "\n");
+}
+
+static void write_summary()
+{
+  FILE *out = create(".txt");
+  if (!out)
+  {
+    return;
+  }
+  uint64_t totals[KINDS] = {0};
+  for (int k = 0; k < KINDS; ++k)
+  {
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+      totals[k] += counts[k][a];
+    }
+  }
+  fprintf(out, "lc3 heatmap after %llu instructions, %d-word lines\n", (unsigned long long)icount, HEATMAP_LINE);
+  fprintf(out, "fetches %llu, reads %llu, writes %llu\n", (unsigned long long)totals[FETCH],
+          (unsigned long long)totals[READ], (unsigned long long)totals[WRITE]);
+
+  uint32_t words, lines;
+  touched(&words, &lines, FETCH, WRITE);
+  fprintf(out, "touched %u words in %u lines", words, lines);
+  touched(&words, &lines, FETCH, FETCH);
+  fprintf(out, ", code %u words in %u lines", words, lines);
+  touched(&words, &lines, READ, WRITE);
+  fprintf(out, ", data %u words in %u lines\n", words, lines);
+
+  fprintf(out, "hottest lines:\n");
+  uint64_t ceiling = UINT64_MAX;
+  uint32_t ceiling_line = 0;
+  for (int n = 0; n < HOTTEST; ++n)
+  {
+    int best = -1;
+    uint64_t best_total = 0;
+    uint64_t best_counts[KINDS] = {0};
+    for (uint32_t line = 0; line < LINES; ++line)
+    {
+      uint64_t c[KINDS];
+      line_counts(line, c);
+      uint64_t total = c[FETCH] + c[READ] + c[WRITE];
+      // Ranked by total and then by address, below the one printed last
+      if (total && (total < ceiling || (total == ceiling && line > ceiling_line)) &&
+          (best < 0 || total > best_total))
+      {
+        best = (int)line;
+        best_total = total;
+        memcpy(best_counts, c, sizeof(c));
+      }
+    }
+    if (best < 0)
+    {
+      break;
+    }
+    fprintf(out, "  x%04X-x%04X", best * HEATMAP_LINE, (best + 1) * HEATMAP_LINE - 1);
+    for (int k = 0; k < KINDS; ++k)
+    {
+      fprintf(out, "  %s %llu", kind_names[k], (unsigned long long)best_counts[k]);
+    }
+    fprintf(out, "\n");
+    ceiling = best_total;
+    ceiling_line = (uint32_t)best;
+  }
+
+  fprintf(out, "reuse distance in lines:\n  %-13s %8s %8s\n", "", "code", "data");
+  uint64_t code_total = 0, data_total = 0;
+  for (int b = 0; b < BUCKETS; ++b)
+  {
+    code_total += code.histogram[b];
+    data_total += data.histogram[b];
+  }
+  for (int b = 0; b < BUCKETS; ++b)
+  {
+    char range[16];
+    if (b == COLD)
+    {
+      snprintf(range, sizeof(range), "first");
+    }
+    else if (b < 2)
+    {
+      snprintf(range, sizeof(range), "%d", b);
+    }
+    else
+    {
+      snprintf(range, sizeof(range), "%u-%u", 1u << (b - 1), (1u << b) - 1);
+    }
+    fprintf(out, "  %-13s %7.2f%% %7.2f%%\n", range, code_total ? 100.0 * code.histogram[b] / code_total : 0.0,
+            data_total ? 100.0 * data.histogram[b] / data_total : 0.0);
+  }
+  fprintf(out, "lines an LRU cache needs to hit:\n  %-13s %8s %8s\n", "", "90%", "99%");
+  print_capacity(out, "code", &code);
+  print_capacity(out, "data", &data);
+  fclose(out);
+}
+
+static void write_all()
+{
+  write_words();
+  write_lines();
+  write_image();
+  write_summary();
+}
+
+int heatmap_open(const char *path_prefix)
+{
+  prefix = path_prefix;
+  // Fail now rather than at exit
+  FILE *out = create(".txt");
+  if (!out)
+  {
+    return 0;
+  }
+  fclose(out);
+  for (int page = 0; page < PAGE_COUNT; ++page)
+  {
+    page_class[page] |= PAGE_PROFILE;
+  }
+  heatmap_enabled = 1;
+  atexit(write_all);
+  return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stdint.h>
+
+// Words in a line, the unit of the per-line counts and reuse distances
+#define HEATMAP_LINE 64
+
+extern int heatmap_enabled;
+
+// Count every guest access from now on and write the results to
+// PREFIX.csv (per word), PREFIX-lines.csv (per line), PREFIX.ppm (one pixel
+// per word, red for writes, green for reads and blue for instruction
+// fetches, on a log scale) and PREFIX.txt (the summary) at exit. All pages
+// are put on the slow path to be counted. Returns 0 on failure.
+int heatmap_open(const char *prefix);
+
+// Run like tier_run() in the interpreter alone, telling fetches apart from
+// the data accesses of the instructions
+void heatmap_run(uint64_t limit);
+
+// Called from the slow memory paths
+void heatmap_read(uint16_t address);
+void heatmap_write(uint16_t address);
+
+#endif
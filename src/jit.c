@@ -0,0 +1,1390 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+#include "jit.h"
+#include "predecode.h"
+
+int jit_dropped;
+int jit_keep_relocs;
+
+// Generated code depends on this build of the emitter
+const char jit_build_id[] = "lc3-jit 6 " __DATE__ " " __TIME__;
+
+#if defined(__x86_64__)
+
+// Entries in the shadow return stack, a power of two
+#define RETURNS_SIZE 64
+
+// Most code emitted for one guest instruction, with room to spare
+#define INSN_CODE_MAX 512
+#define BLOCK_CODE_MAX ((JIT_TRACE_MAX + 2) * INSN_CODE_MAX)
+#define RELOC_MAX (8 * JIT_TRACE_MAX)
+
+// Generated code keeps R0-R7 in host registers for the whole block and only
+// writes them back to reg[] at exits and around calls to the slow memory
+// paths. COND is kept lazily as the last result in r10 and only turned into
+// FL_* when written back. PC is known at every point of the block and is only
+// stored on the way out. rdi holds reg, rsi memory and r11 page_class, and
+// eax, ecx and edx are scratch. The instruction limit passed in is kept at
+// [rsp] for traces that loop.
+enum
+{
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+// Host register of each guest register
+static const uint8_t host[8] = {RBX, RBP, R12, R13, R14, R15, R8, R9};
+
+// Saved by the block itself, the guest registers in the others are reloaded
+// after calls
+static const uint8_t callee_saved[] = {RBX, RBP, R12, R13, R14, R15};
+#define CALLEE_SAVED (sizeof(callee_saved) / sizeof(callee_saved[0]))
+
+enum
+{
+  JMP = 0,
+  JZ = 0x84,
+  JNZ = 0x85,
+  JS = 0x88,
+  JNS = 0x89,
+  JLE = 0x8E,
+  JG = 0x8F,
+  JA = 0x87,
+};
+
+// Offset of a guest register from rdi
+#define REG_DISP(r) ((r) * 2)
+
+static uint8_t *arena;
+static size_t arena_used;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Host addresses by symbol, for relocating cached code
+static uintptr_t symbols[JIT_SYM_COUNT];
+
+// Where chained code enters a block, past the prologue, and the most
+// instructions it runs. Generated code indexes links by guest address.
+struct link
+{
+  const uint8_t *body;
+  uint16_t length;
+};
+
+static struct link links[MEMORY_MAX];
+
+// Shadow return stack, only touched by generated code and jit_unlink().
+// Entries are checked against R7 before they are used, so overflowing or
+// getting out of step with the guest only costs a missed prediction.
+struct shadow_return
+{
+  uint16_t address;
+  uint16_t length;
+  uint32_t reserved;
+  const uint8_t *body;
+};
+
+static struct
+{
+  uint32_t top;
+  uint32_t reserved[3];
+  struct shadow_return entries[RETURNS_SIZE];
+} returns;
+
+// Size of the prologue, the same for every block
+static size_t body_offset;
+
+// Code being emitted. Each thread emits into its own buffer and only takes
+// the arena lock to copy the finished block in.
+static _Thread_local uint8_t code[BLOCK_CODE_MAX];
+static _Thread_local size_t pos;
+static _Thread_local struct jit_reloc relocs[RELOC_MAX];
+static _Thread_local uint16_t reloc_count;
+
+// Guest registers held in host registers so far in the block, and those
+// changed since
+static _Thread_local uint8_t loaded;
+static _Thread_local uint8_t dirty;
+
+// Guest registers whose value is known while compiling, from LEA, JSR or
+// arithmetic on known values, and the values
+static _Thread_local uint8_t known;
+static _Thread_local uint16_t values[8];
+
+// COND is not computed where it is set. flags_src is the host register
+// holding the last result, or one of these.
+enum
+{
+  FLAGS_MEMORY = -1, // Up to date in reg[R_COND]
+  FLAGS_DEAD = -2,   // Set by an instruction whose flags nothing reads
+};
+
+static _Thread_local int flags_src;
+
+// For each instruction of the block or trace, whether anything may read the
+// flags it sets
+static _Thread_local uint8_t flags_used[JIT_TRACE_MAX];
+
+static void byte(uint8_t b)
+{
+  code[pos++] = b;
+}
+
+static void u16(uint16_t v)
+{
+  memcpy(code + pos, &v, sizeof(v));
+  pos += sizeof(v);
+}
+
+static void u32(uint32_t v)
+{
+  memcpy(code + pos, &v, sizeof(v));
+  pos += sizeof(v);
+}
+
+static void u64(uint64_t v)
+{
+  memcpy(code + pos, &v, sizeof(v));
+  pos += sizeof(v);
+}
+
+// A host address, recorded so cached code can be relocated
+static void symbol(int sym)
+{
+  relocs[reloc_count].offset = (uint32_t)pos;
+  relocs[reloc_count].symbol = (uint32_t)sym;
+  ++reloc_count;
+  u64(symbols[sym]);
+}
+
+// A forward jump, returns the position to hand to land() later
+static size_t jump(uint8_t cc)
+{
+  if (cc == JMP)
+  {
+    byte(0xE9);
+  }
+  else
+  {
+    byte(0x0F);
+    byte(cc);
+  }
+  u32(0);
+  return pos;
+}
+
+static void land(size_t from)
+{
+  int32_t rel = (int32_t)(pos - from);
+  memcpy(code + from - 4, &rel, sizeof(rel));
+}
+
+// REX prefix for a 32-bit operation with r in ModRM.reg and b in ModRM.rm
+static void rex(int r, int b)
+{
+  if ((r | b) & 8)
+  {
+    byte(0x40 | (r & 8) >> 1 | (b & 8) >> 3);
+  }
+}
+
+// ModRM for [rdi + reg[g]]
+static void guest_slot(int r, int g)
+{
+  byte(0x40 | (r & 7) << 3 | RDI);
+  byte(REG_DISP(g));
+}
+
+// movzx r32, word [rdi + reg[g]]
+static void load_slot(int r, int g)
+{
+  rex(r, RDI);
+  byte(0x0F);
+  byte(0xB7);
+  guest_slot(r, g);
+}
+
+// mov word [rdi + reg[g]], r16
+static void store_slot(int g, int r)
+{
+  byte(0x66);
+  rex(r, RDI);
+  byte(0x89);
+  guest_slot(r, g);
+}
+
+// mov word [rdi + reg[g]], imm16
+static void store_slot_imm(int g, uint16_t value)
+{
+  byte(0x66);
+  byte(0xC7);
+  guest_slot(0, g);
+  u16(value);
+}
+
+static void mov(int to, int from)
+{
+  if (to != from)
+  {
+    rex(from, to);
+    byte(0x89);
+    byte(0xC0 | (from & 7) << 3 | (to & 7));
+  }
+}
+
+static void mov_imm(int to, uint32_t value)
+{
+  rex(0, to);
+  byte(0xB8 | (to & 7));
+  u32(value);
+}
+
+static void push(int r)
+{
+  rex(0, r);
+  byte(0x50 | (r & 7));
+}
+
+static void pop(int r)
+{
+  rex(0, r);
+  byte(0x58 | (r & 7));
+}
+
+// op r16, r16 for the two-operand ALU opcodes (add, and)
+static void alu(uint8_t op, int to, int from)
+{
+  byte(0x66);
+  rex(from, to);
+  byte(op);
+  byte(0xC0 | (from & 7) << 3 | (to & 7));
+}
+
+// op r16, imm16, ext selects the operation (0 add, 4 and)
+static void alu_imm(int ext, int to, uint16_t value)
+{
+  byte(0x66);
+  rex(0, to);
+  byte(0x81);
+  byte(0xC0 | ext << 3 | (to & 7));
+  u16(value);
+}
+
+// The host register holding guest register g, loaded on first use. Blocks
+// are straight-line code, so a load emitted once covers the rest of it.
+static int use(int g)
+{
+  if (!(loaded & 1 << g))
+  {
+    load_slot(host[g], g);
+    loaded |= 1 << g;
+  }
+  return host[g];
+}
+
+// The host register for a new value of guest register g
+static int def(int g)
+{
+  loaded |= 1 << g;
+  dirty |= 1 << g;
+  known &= ~(1 << g);
+  return host[g];
+}
+
+// Guest register g is set to a constant
+static int def_const(int g, uint16_t value)
+{
+  int r = def(g);
+  mov_imm(r, value);
+  known |= 1 << g;
+  values[g] = value;
+  return r;
+}
+
+// The result in r sets COND, n counts the instruction
+static void set_flags(int r, uint32_t n)
+{
+  flags_src = flags_used[n - 1] ? r : FLAGS_DEAD;
+}
+
+// For writes that do not set COND, which must then move out of the way
+static int def_keeping_flags(int g)
+{
+  if (flags_src == host[g])
+  {
+    mov(R10, host[g]);
+    flags_src = R10;
+  }
+  return def(g);
+}
+
+// Write changed guest registers and COND back to reg[], only touches edx
+static void spill()
+{
+  for (int g = 0; g < 8; ++g)
+  {
+    if (dirty & 1 << g)
+    {
+      store_slot(g, host[g]);
+    }
+  }
+  if (flags_src >= 0)
+  {
+    // FL_POS + (zero ? 1 : 0) + (negative ? 3 : 0)
+    int r = flags_src;
+    rex(RDX, r); // movsx edx, r16
+    byte(0x0F);
+    byte(0xBF);
+    byte(0xC0 | RDX << 3 | (r & 7));
+    byte(0xC1); // sar edx, 31
+    byte(0xFA);
+    byte(31);
+    byte(0x83); // and edx, 3
+    byte(0xE2);
+    byte(3);
+    byte(0x66); // cmp r16, 1
+    rex(0, r);
+    byte(0x83);
+    byte(0xF8 | (r & 7));
+    byte(1);
+    byte(0x83); // adc edx, FL_POS
+    byte(0xD2);
+    byte(FL_POS);
+    store_slot(R_COND, RDX);
+  }
+}
+
+// Helpers called from generated code see icount counting the instruction
+// in progress, as they would under the interpreter. r is rax or rcx.
+static void adjust_icount(int r, int32_t n)
+{
+  byte(0x48); // mov r, &icount
+  byte(0xB8 | r);
+  symbol(JIT_SYM_ICOUNT);
+  byte(0x48); // add or sub qword [r], imm32
+  byte(0x81);
+  byte((n >= 0 ? 0x00 : 0x28) | r);
+  u32((uint32_t)(n >= 0 ? n : -n));
+}
+
+// Call a slow memory path with the address in ecx and, for stores, the value
+// in eax. reg[] is up to date during the call. The result is left in eax.
+static void call_out(int sym, uint32_t n, int store)
+{
+  spill();
+  push(RDI);
+  push(RSI);
+  push(R10);
+  push(R11);
+  byte(0x48); // sub rsp, 8, for the stack alignment of the call
+  byte(0x83);
+  byte(0xEC);
+  byte(8);
+  if (store)
+  {
+    mov(RSI, RAX);
+  }
+  mov(RDI, RCX);
+  adjust_icount(RAX, (int32_t)n);
+  byte(0x48); // mov rax, fn
+  byte(0xB8);
+  symbol(sym);
+  byte(0xFF); // call rax
+  byte(0xD0);
+  adjust_icount(RCX, -(int32_t)n);
+  byte(0x48); // add rsp, 8
+  byte(0x83);
+  byte(0xC4);
+  byte(8);
+  pop(R11);
+  pop(R10);
+  pop(RSI);
+  pop(RDI);
+  for (int g = 0; g < 8; ++g)
+  {
+    if ((loaded & 1 << g) && host[g] >= R8 && host[g] <= R11)
+    {
+      load_slot(host[g], g);
+    }
+  }
+}
+
+// Leave with PC already stored
+static void leave(uint32_t n)
+{
+  spill();
+  byte(0xB8); // mov eax, n
+  u32(n);
+  byte(0x48); // add rsp, 16, the saved limit
+  byte(0x83);
+  byte(0xC4);
+  byte(16);
+  for (int i = CALLEE_SAVED; i-- > 0;)
+  {
+    pop(callee_saved[i]);
+  }
+  byte(0xC3); // ret
+}
+
+static void leave_to(uint16_t pc, uint32_t n)
+{
+  store_slot_imm(R_PC, pc);
+  leave(n);
+}
+
+// ecx = address, zero extended
+static void address_const(uint16_t address)
+{
+  mov_imm(RCX, address);
+}
+
+static void address_reg(int base, uint16_t offset)
+{
+  int r = use(base);
+  rex(RCX, r); // lea ecx, [r + offset]
+  byte(0x8D);
+  byte(0x80 | RCX << 3 | (r & 7));
+  if ((r & 7) == RSP)
+  {
+    byte(0x24);
+  }
+  u32(offset);
+  byte(0x0F); // movzx ecx, cx
+  byte(0xB7);
+  byte(0xC9);
+}
+
+// edx = page_class[ecx >> PAGE_SHIFT] & mask, flags set
+static void test_page(uint8_t mask)
+{
+  byte(0x89); // mov edx, ecx
+  byte(0xCA);
+  byte(0xC1); // shr edx, PAGE_SHIFT
+  byte(0xEA);
+  byte(PAGE_SHIFT);
+  byte(0x41); // test byte [r11 + rdx], mask
+  byte(0xF6);
+  byte(0x04);
+  byte(0x13);
+  byte(mask);
+}
+
+// eax = the word at ecx, n instructions into the block
+static void read_word(uint32_t n)
+{
+  test_page(PAGE_READ_SLOW);
+  size_t slow = jump(JNZ);
+  byte(0x0F); // movzx eax, word [rsi + rcx*2]
+  byte(0xB7);
+  byte(0x04);
+  byte(0x4E);
+  size_t done = jump(JMP);
+
+  land(slow);
+  call_out(JIT_SYM_READ, n, 0);
+  byte(0x0F); // movzx eax, ax
+  byte(0xB7);
+  byte(0xC0);
+  land(done);
+}
+
+static int jit_store(uint16_t address, uint16_t value)
+{
+  jit_dropped = 0;
+  mem_write_slow(address, value);
+  return jit_dropped;
+}
+
+// Whether loads from address can skip the page check. Device pages are fixed
+// and read watchpoints only exist under the debugger, which never runs
+// generated code.
+static int plain_read(uint16_t address)
+{
+  return !(page_class[address >> PAGE_SHIFT] & PAGE_READ_SLOW);
+}
+
+// r = the word at a constant address
+static void read_const(int r, uint16_t address, uint32_t n)
+{
+  if (!plain_read(address))
+  {
+    address_const(address);
+    read_word(n);
+    mov(r, RAX);
+    return;
+  }
+  rex(r, RSI); // movzx r32, word [rsi + address*2]
+  byte(0x0F);
+  byte(0xB7);
+  byte(0x86 | (r & 7) << 3);
+  u32((uint32_t)address * 2);
+}
+
+// Guest register g = the word at a constant address
+static int load_const(int g, uint16_t address, uint32_t n)
+{
+  if (!plain_read(address))
+  {
+    // Calls out, so g keeps its old value until the word is back
+    read_const(RAX, address, n);
+    int r = def(g);
+    mov(r, RAX);
+    return r;
+  }
+  int r = def(g);
+  read_const(r, address, n);
+  return r;
+}
+
+// Hand the store of ax at ecx to jit_store(). One that invalidated generated
+// code leaves the block with PC at next.
+static void store_slow(uint32_t n, uint16_t next)
+{
+  call_out(JIT_SYM_STORE, n, 1);
+  byte(0x85); // test eax, eax
+  byte(0xC0);
+  size_t kept = jump(JZ);
+  leave_to(next, n);
+  land(kept);
+}
+
+// Store ax at ecx
+static void write_word(uint32_t n, uint16_t next)
+{
+  test_page(PAGE_WRITE_SLOW);
+  size_t slow = jump(JNZ);
+  byte(0x66); // mov word [rsi + rcx*2], ax
+  byte(0x89);
+  byte(0x04);
+  byte(0x4E);
+  size_t done = jump(JMP);
+
+  land(slow);
+  store_slow(n, next);
+  land(done);
+}
+
+// Store r16 at a constant address. Pages still become code at run time, so
+// the class byte of the page is tested, but its index is folded in.
+static void write_const(uint16_t address, int r, uint32_t n, uint16_t next)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_MMIO)
+  {
+    address_const(address);
+    mov(RAX, r);
+    write_word(n, next);
+    return;
+  }
+  byte(0x41); // test byte [r11 + page], PAGE_WRITE_SLOW
+  byte(0xF6);
+  byte(0x83);
+  u32(address >> PAGE_SHIFT);
+  byte(PAGE_WRITE_SLOW);
+  size_t slow = jump(JNZ);
+  byte(0x66); // mov word [rsi + address*2], r16
+  rex(r, RSI);
+  byte(0x89);
+  byte(0x86 | (r & 7) << 3);
+  u32((uint32_t)address * 2);
+  size_t done = jump(JMP);
+
+  land(slow);
+  address_const(address);
+  mov(RAX, r);
+  store_slow(n, next);
+  land(done);
+}
+
+// Condition codes taken for each BR nzp mask, from a test of the last result
+static const uint8_t branch_cc[8] = {0, JG, JZ, JNS, JS, JNZ, JLE, JMP};
+
+// Push next onto the shadow return stack with the code linked there now
+static void push_return(uint16_t next)
+{
+  byte(0x48); // mov rax, &returns
+  byte(0xB8);
+  symbol(JIT_SYM_RETURNS);
+  byte(0x8B); // mov edx, [rax]
+  byte(0x10);
+  byte(0xFF); // inc edx
+  byte(0xC2);
+  byte(0x83); // and edx, RETURNS_SIZE - 1
+  byte(0xE2);
+  byte(RETURNS_SIZE - 1);
+  byte(0x89); // mov [rax], edx
+  byte(0x10);
+  byte(0xC1); // shl edx, 4
+  byte(0xE2);
+  byte(4);
+  byte(0x48); // lea rdx, [rax + rdx + 16]
+  byte(0x8D);
+  byte(0x54);
+  byte(0x10);
+  byte(16);
+  byte(0x66); // mov word [rdx], next
+  byte(0xC7);
+  byte(0x02);
+  u16(next);
+  byte(0x48); // mov rcx, links
+  byte(0xB9);
+  symbol(JIT_SYM_LINKS);
+  byte(0x48); // mov rax, [rcx + links[next].body]
+  byte(0x8B);
+  byte(0x81);
+  u32((uint32_t)(next * sizeof(struct link) + offsetof(struct link, body)));
+  byte(0x48); // mov [rdx + 8], rax
+  byte(0x89);
+  byte(0x42);
+  byte(8);
+  byte(0x0F); // movzx eax, word [rcx + links[next].length]
+  byte(0xB7);
+  byte(0x81);
+  u32((uint32_t)(next * sizeof(struct link) + offsetof(struct link, length)));
+  byte(0x66); // mov [rdx + 2], ax
+  byte(0x89);
+  byte(0x42);
+  byte(2);
+}
+
+// RET: pop the shadow return stack and, when it predicted R7 and there is
+// room under the limit, count this block and jump into the code linked at
+// the return address. Otherwise leave normally.
+static void emit_return(uint32_t n)
+{
+  store_slot(R_PC, use(R_R7));
+  spill();
+  // Everything is in reg[] now, so the guest's host registers are free
+  dirty = 0;
+  flags_src = FLAGS_MEMORY;
+
+  byte(0x48); // mov rax, &returns
+  byte(0xB8);
+  symbol(JIT_SYM_RETURNS);
+  byte(0x8B); // mov edx, [rax]
+  byte(0x10);
+  byte(0x89); // mov ecx, edx
+  byte(0xD1);
+  byte(0xFF); // dec edx
+  byte(0xCA);
+  byte(0x83); // and edx, RETURNS_SIZE - 1
+  byte(0xE2);
+  byte(RETURNS_SIZE - 1);
+  byte(0x89); // mov [rax], edx
+  byte(0x10);
+  byte(0xC1); // shl ecx, 4
+  byte(0xE1);
+  byte(4);
+  byte(0x48); // lea rcx, [rax + rcx + 16]
+  byte(0x8D);
+  byte(0x4C);
+  byte(0x08);
+  byte(16);
+  byte(0x66); // cmp [rcx], r9w, R7
+  byte(0x44);
+  byte(0x39);
+  byte(0x09);
+  size_t miss = jump(JNZ);
+  byte(0x4C); // mov r8, [rcx + 8]
+  byte(0x8B);
+  byte(0x41);
+  byte(8);
+  byte(0x4D); // test r8, r8
+  byte(0x85);
+  byte(0xC0);
+  size_t unlinked = jump(JZ);
+  byte(0x44); // movzx r9d, word [rcx + 2]
+  byte(0x0F);
+  byte(0xB7);
+  byte(0x49);
+  byte(2);
+  byte(0x48); // mov rcx, &icount
+  byte(0xB9);
+  symbol(JIT_SYM_ICOUNT);
+  byte(0x48); // add qword [rcx], n
+  byte(0x81);
+  byte(0x01);
+  u32(n);
+  byte(0x48); // mov rax, [rcx]
+  byte(0x8B);
+  byte(0x01);
+  byte(0x4C); // add rax, r9
+  byte(0x01);
+  byte(0xC8);
+  byte(0x48); // cmp rax, [rsp]
+  byte(0x3B);
+  byte(0x04);
+  byte(0x24);
+  size_t over = jump(JA);
+  byte(0x41); // jmp r8
+  byte(0xFF);
+  byte(0xE0);
+  land(over);
+  leave(0);
+  land(miss);
+  land(unlinked);
+  leave(n);
+}
+
+// Jump when the nzp condition of a BR holds, or when it does not
+static size_t jump_cond(uint8_t nzp, int holds)
+{
+  if (flags_src >= 0)
+  {
+    byte(0x66); // test r16, r16
+    rex(flags_src, flags_src);
+    byte(0x85);
+    byte(0xC0 | (flags_src & 7) << 3 | (flags_src & 7));
+    return jump(holds ? branch_cc[nzp] : branch_cc[nzp] ^ 1);
+  }
+  byte(0x66); // test word [rdi + reg[R_COND]], nzp
+  byte(0xF7);
+  guest_slot(0, R_COND);
+  u16(nzp);
+  return jump(holds ? JNZ : JZ);
+}
+
+// Leave unless guest register g holds the expected target, PC is then the
+// actual one
+static void guard_target(int g, uint16_t target, uint32_t n)
+{
+  if ((known & 1 << g) && values[g] == target)
+  {
+    return;
+  }
+  int r = use(g);
+  byte(0x66); // cmp r16, target
+  rex(0, r);
+  byte(0x81);
+  byte(0xF8 | (r & 7));
+  u16(target);
+  size_t same = jump(JZ);
+  store_slot(R_PC, r);
+  leave(n);
+  land(same);
+}
+
+// n counts this instruction. In a trace, follow is the address the recorded
+// path continued at: branches only leave the trace when they go elsewhere.
+// Blocks pass -1 and every control transfer leaves.
+static void emit_insn(uint16_t address, uint16_t instr, uint32_t n, int32_t follow)
+{
+  struct insn d = predecode_decode(address, instr);
+  uint16_t next = address + 1;
+  int r;
+
+  switch (instr >> 12)
+  {
+  case OP_ADD:
+  case OP_AND:
+  {
+    int add = (instr >> 12) == OP_ADD;
+    uint8_t op = add ? 0x01 : 0x21;
+    int ext = add ? 0 : 4;
+    int other_known = (instr & 0x20) || (known & 1 << d.r2);
+    uint16_t other = (instr & 0x20) ? d.imm : values[d.r2];
+    if ((known & 1 << d.r1) && other_known)
+    {
+      r = def_const(d.r0, add ? values[d.r1] + other : values[d.r1] & other);
+    }
+    else if (!add && (instr & 0x20) && d.imm == 0)
+    {
+      r = def_const(d.r0, 0);
+    }
+    else if (instr & 0x20)
+    {
+      int a = use(d.r1);
+      r = def(d.r0);
+      mov(r, a);
+      alu_imm(ext, r, d.imm);
+    }
+    else
+    {
+      int a = use(d.r1);
+      int b = use(d.r2);
+      r = def(d.r0);
+      // Both operations commute, so the destination may be either source
+      if (r == b)
+      {
+        alu(op, r, a);
+      }
+      else
+      {
+        mov(r, a);
+        alu(op, r, b);
+      }
+    }
+    set_flags(r, n);
+    break;
+  }
+  case OP_NOT:
+  {
+    if (known & 1 << d.r1)
+    {
+      r = def_const(d.r0, ~values[d.r1]);
+      set_flags(r, n);
+      break;
+    }
+    int a = use(d.r1);
+    r = def(d.r0);
+    mov(r, a);
+    byte(0x66); // not r16
+    rex(0, r);
+    byte(0xF7);
+    byte(0xD0 | (r & 7));
+    set_flags(r, n);
+    break;
+  }
+  case OP_LEA:
+    r = def_const(d.r0, d.imm);
+    set_flags(r, n);
+    break;
+  case OP_LD:
+    r = load_const(d.r0, d.imm, n);
+    set_flags(r, n);
+    break;
+  case OP_LDI:
+    read_const(RCX, d.imm, n);
+    read_word(n);
+    r = def(d.r0);
+    mov(r, RAX);
+    set_flags(r, n);
+    break;
+  case OP_LDR:
+    if (known & 1 << d.r1)
+    {
+      r = load_const(d.r0, values[d.r1] + d.imm, n);
+    }
+    else
+    {
+      address_reg(d.r1, d.imm);
+      read_word(n);
+      r = def(d.r0);
+      mov(r, RAX);
+    }
+    set_flags(r, n);
+    break;
+  case OP_ST:
+    write_const(d.imm, use(d.r0), n, next);
+    break;
+  case OP_STI:
+    read_const(RCX, d.imm, n);
+    mov(RAX, use(d.r0));
+    write_word(n, next);
+    break;
+  case OP_STR:
+    if (known & 1 << d.r1)
+    {
+      write_const(values[d.r1] + d.imm, use(d.r0), n, next);
+    }
+    else
+    {
+      address_reg(d.r1, d.imm);
+      mov(RAX, use(d.r0));
+      write_word(n, next);
+    }
+    break;
+  case OP_BR:
+    if (follow >= 0 && (d.r0 == 7 || d.imm == next))
+    {
+      // Always lands on the path
+    }
+    else if (d.r0 == 7)
+    {
+      leave_to(d.imm, n);
+    }
+    else if (follow >= 0 && d.r0)
+    {
+      // Leave when the branch goes the other way than it did when recorded
+      int taken = follow == d.imm;
+      size_t stay = jump_cond(d.r0, taken);
+      leave_to(taken ? next : d.imm, n);
+      land(stay);
+    }
+    else if (d.r0)
+    {
+      size_t not_taken = jump_cond(d.r0, 0);
+      leave_to(d.imm, n);
+      land(not_taken);
+      leave_to(next, n);
+    }
+    break;
+  case OP_JMP:
+    if (follow >= 0)
+    {
+      guard_target(d.r1, (uint16_t)follow, n);
+    }
+    else if (d.r1 == R_R7)
+    {
+      emit_return(n);
+    }
+    else
+    {
+      store_slot(R_PC, use(d.r1));
+      leave(n);
+    }
+    break;
+  case OP_JSR:
+    // R7 is written first, as in execute()
+    def_keeping_flags(R_R7);
+    def_const(R_R7, next);
+    if (follow >= 0)
+    {
+      if (!(instr & 0x800))
+      {
+        guard_target(d.r1, (uint16_t)follow, n);
+      }
+    }
+    else if (instr & 0x800)
+    {
+      push_return(next);
+      leave_to(d.imm, n);
+    }
+    else
+    {
+      store_slot(R_PC, use(d.r1));
+      push_return(next);
+      leave(n);
+    }
+    break;
+  }
+}
+
+// Copy finished code into the arena
+static uint8_t *place(const uint8_t *from, size_t size)
+{
+  uint8_t *to = NULL;
+  pthread_mutex_lock(&arena_lock);
+  if (arena_used + size <= JIT_ARENA_SIZE)
+  {
+    to = arena + arena_used;
+    arena_used = (arena_used + size + 15) & ~(size_t)15;
+  }
+  pthread_mutex_unlock(&arena_lock);
+  if (to)
+  {
+    memcpy(to, from, size);
+  }
+  return to;
+}
+
+// Fetches from devices and the rare instructions stay with execute()
+static int compiles(uint16_t address)
+{
+  uint16_t op = memory[address] >> 12;
+  return !(page_class[address >> PAGE_SHIFT] & PAGE_MMIO) && op != OP_TRAP && op != OP_RTI && op != OP_RES;
+}
+
+static void prologue()
+{
+  pos = 0;
+  reloc_count = 0;
+  loaded = 0;
+  dirty = 0;
+  known = 0;
+  flags_src = FLAGS_MEMORY;
+
+  for (size_t i = 0; i < CALLEE_SAVED; ++i)
+  {
+    push(callee_saved[i]);
+  }
+  push(RSI); // The limit, twice for the stack alignment of calls
+  push(RSI);
+  byte(0x48); // mov rsi, memory
+  byte(0xBE);
+  symbol(JIT_SYM_MEMORY);
+  byte(0x49); // mov r11, page_class
+  byte(0xBB);
+  symbol(JIT_SYM_PAGE_CLASS);
+}
+
+static int finish(uint32_t n, struct jit_code *out)
+{
+  uint8_t *placed = place(code, pos);
+  if (!placed)
+  {
+    return JIT_FULL;
+  }
+  out->fn = (jit_fn)(void *)placed;
+  out->length = (uint16_t)n;
+  out->size = (uint32_t)pos;
+  out->reloc_count = reloc_count;
+  if (jit_keep_relocs)
+  {
+    out->relocs = malloc(sizeof(*out->relocs) * reloc_count);
+    if (out->relocs)
+    {
+      memcpy(out->relocs, relocs, sizeof(*out->relocs) * reloc_count);
+    }
+  }
+  return JIT_OK;
+}
+
+int jit_init()
+{
+  if (arena)
+  {
+    return 1;
+  }
+  arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+  {
+    arena = NULL;
+    return 0;
+  }
+  symbols[JIT_SYM_MEMORY] = (uintptr_t)memory;
+  symbols[JIT_SYM_PAGE_CLASS] = (uintptr_t)page_class;
+  symbols[JIT_SYM_ICOUNT] = (uintptr_t)&icount;
+  symbols[JIT_SYM_READ] = (uintptr_t)mem_read_slow;
+  symbols[JIT_SYM_STORE] = (uintptr_t)jit_store;
+  symbols[JIT_SYM_RETURNS] = (uintptr_t)&returns;
+  symbols[JIT_SYM_LINKS] = (uintptr_t)links;
+  prologue();
+  body_offset = pos;
+  return 1;
+}
+
+static int sets_flags(uint16_t instr)
+{
+  uint16_t op = instr >> 12;
+  return op == OP_ADD || op == OP_AND || op == OP_NOT || op == OP_LEA || op == OP_LD || op == OP_LDI || op == OP_LDR;
+}
+
+// Instructions that test COND or may leave, after which anything may
+static int reads_flags(uint16_t instr)
+{
+  uint16_t op = instr >> 12;
+  return (op == OP_BR && (instr & 0x0E00)) || op == OP_JMP || op == OP_JSR || op == OP_ST || op == OP_STI ||
+         op == OP_STR;
+}
+
+// Backward liveness of COND over the path, filling flags_used. Returns
+// whether the COND coming in may be read.
+static int flag_liveness(const uint16_t *path, uint16_t count)
+{
+  int live = 1; // Whatever runs after the path may read it
+  for (uint16_t i = count; i-- > 0;)
+  {
+    uint16_t instr = memory[path[i]];
+    if (sets_flags(instr))
+    {
+      flags_used[i] = (uint8_t)live;
+      live = 0;
+    }
+    else if (reads_flags(instr))
+    {
+      live = 1;
+    }
+  }
+  return live;
+}
+
+int jit_compile(uint16_t address, struct jit_code *out)
+{
+  out->relocs = NULL;
+
+  uint16_t path[JIT_BLOCK_MAX];
+  uint16_t n = 0;
+  int ended = 0;
+  while (n < JIT_BLOCK_MAX && !ended && compiles(address + n))
+  {
+    path[n] = address + n;
+    ended = insn_ends_block(memory[path[n]]);
+    ++n;
+  }
+  if (n == 0)
+  {
+    return JIT_EMPTY;
+  }
+  flag_liveness(path, n);
+
+  prologue();
+  for (uint16_t i = 0; i < n; ++i)
+  {
+    emit_insn(path[i], memory[path[i]], i + 1, -1);
+  }
+  if (!ended)
+  {
+    leave_to(address + n, n);
+  }
+  return finish(n, out);
+}
+
+// Guest registers an instruction reads or writes
+static uint8_t touches(uint16_t address, uint16_t instr)
+{
+  struct insn d = predecode_decode(address, instr);
+  switch (instr >> 12)
+  {
+  case OP_ADD:
+  case OP_AND:
+    return 1 << d.r0 | 1 << d.r1 | ((instr & 0x20) ? 0 : 1 << d.r2);
+  case OP_NOT:
+  case OP_LDR:
+  case OP_STR:
+    return 1 << d.r0 | 1 << d.r1;
+  case OP_LEA:
+  case OP_LD:
+  case OP_LDI:
+  case OP_ST:
+  case OP_STI:
+    return 1 << d.r0;
+  case OP_JMP:
+    return 1 << d.r1;
+  case OP_JSR:
+    return 1 << R_R7 | ((instr & 0x800) ? 0 : 1 << d.r1);
+  }
+  return 0;
+}
+
+int jit_compile_trace(const uint16_t *path, uint16_t count, struct jit_code *out)
+{
+  out->relocs = NULL;
+  if (count == 0 || count > JIT_TRACE_MAX)
+  {
+    return JIT_EMPTY;
+  }
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    if (!compiles(path[i]))
+    {
+      return JIT_EMPTY;
+    }
+  }
+  int flags_in = flag_liveness(path, count);
+  prologue();
+
+  int loops = path[count] == path[0];
+  size_t top = 0;
+  if (loops)
+  {
+    // Every pass starts with the same registers held and changed and COND in
+    // the same place, so the loop edge can jump straight back to the top
+    uint8_t used = 0, changed = 0;
+    for (uint16_t i = 0; i < count; ++i)
+    {
+      uint16_t instr = memory[path[i]];
+      used |= touches(path[i], instr);
+      if (sets_flags(instr))
+      {
+        changed |= 1 << ((instr >> 9) & 7);
+      }
+      if ((instr >> 12) == OP_JSR)
+      {
+        changed |= 1 << R_R7;
+      }
+    }
+    for (int g = 0; g < 8; ++g)
+    {
+      if (used & 1 << g)
+      {
+        use(g);
+      }
+    }
+    dirty = changed;
+    flags_src = FLAGS_DEAD;
+    if (flags_in)
+    {
+      // r10 = COND & FL_NEG ? 0x8000 : COND & FL_ZRO ? 0 : 1
+      load_slot(RDX, R_COND);
+      byte(0x31); // xor eax, eax
+      byte(0xC0);
+      mov_imm(RCX, 0x8000);
+      mov_imm(R10, 1);
+      byte(0xF6); // test dl, FL_ZRO
+      byte(0xC2);
+      byte(FL_ZRO);
+      byte(0x44); // cmovnz r10d, eax
+      byte(0x0F);
+      byte(0x45);
+      byte(0xD0);
+      byte(0xF6); // test dl, FL_NEG
+      byte(0xC2);
+      byte(FL_NEG);
+      byte(0x44); // cmovnz r10d, ecx
+      byte(0x0F);
+      byte(0x45);
+      byte(0xD1);
+      flags_src = R10;
+    }
+    top = pos;
+  }
+  // Nothing is known at the top of a pass
+  known = 0;
+
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    emit_insn(path[i], memory[path[i]], i + 1, path[i + 1]);
+  }
+
+  if (loops)
+  {
+    if (flags_in)
+    {
+      mov(R10, flags_src);
+      flags_src = R10;
+    }
+    // Count the pass and go round again while another one fits the limit
+    byte(0x48); // mov rcx, &icount
+    byte(0xB9);
+    symbol(JIT_SYM_ICOUNT);
+    byte(0x48); // add qword [rcx], count
+    byte(0x81);
+    byte(0x01);
+    u32(count);
+    byte(0x48); // mov rax, [rcx]
+    byte(0x8B);
+    byte(0x01);
+    byte(0x48); // add rax, count
+    byte(0x05);
+    u32(count);
+    byte(0x48); // cmp rax, [rsp]
+    byte(0x3B);
+    byte(0x04);
+    byte(0x24);
+    size_t done = jump(JA);
+    byte(0xE9); // jmp top
+    u32((uint32_t)(int32_t)(top - (pos + 4)));
+    land(done);
+    leave_to(path[0], 0);
+  }
+  else
+  {
+    leave_to(path[count], count);
+  }
+  return finish(count, out);
+}
+
+int jit_load(const uint8_t *from, uint32_t size, const struct jit_reloc *table, uint16_t count, jit_fn *fn)
+{
+  if (size > BLOCK_CODE_MAX)
+  {
+    return JIT_EMPTY;
+  }
+  // Patch a private copy first, the arena only ever sees finished code
+  memcpy(code, from, size);
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    if (table[i].symbol >= JIT_SYM_COUNT || table[i].offset + sizeof(uint64_t) > size)
+    {
+      return JIT_EMPTY;
+    }
+    memcpy(code + table[i].offset, &symbols[table[i].symbol], sizeof(uint64_t));
+  }
+  uint8_t *placed = place(code, size);
+  if (!placed)
+  {
+    return JIT_FULL;
+  }
+  *fn = (jit_fn)(void *)placed;
+  return JIT_OK;
+}
+
+const uint8_t *jit_code_bytes(jit_fn fn)
+{
+  return (const uint8_t *)(void *)fn;
+}
+
+void jit_link(uint16_t address, jit_fn fn, uint16_t length)
+{
+  // Every block has the same prologue, so the frame set up by the block that
+  // returns fits the one it jumps into
+  links[address].body = (const uint8_t *)(void *)fn + body_offset;
+  links[address].length = length;
+}
+
+void jit_unlink(uint16_t address)
+{
+  links[address].body = NULL;
+  for (int i = 0; i < RETURNS_SIZE; ++i)
+  {
+    if (returns.entries[i].address == address)
+    {
+      returns.entries[i].body = NULL;
+    }
+  }
+}
+
+void jit_reset()
+{
+  pthread_mutex_lock(&arena_lock);
+  arena_used = 0;
+  pthread_mutex_unlock(&arena_lock);
+  memset(links, 0, sizeof(links));
+  memset(&returns, 0, sizeof(returns));
+}
+
+#else
+
+int jit_init()
+{
+  return 0;
+}
+
+int jit_compile(uint16_t address, struct jit_code *out)
+{
+  (void)address;
+  out->relocs = NULL;
+  return JIT_EMPTY;
+}
+
+int jit_compile_trace(const uint16_t *path, uint16_t count, struct jit_code *out)
+{
+  (void)path;
+  (void)count;
+  out->relocs = NULL;
+  return JIT_EMPTY;
+}
+
+int jit_load(const uint8_t *from, uint32_t size, const struct jit_reloc *table, uint16_t count, jit_fn *fn)
+{
+  (void)from;
+  (void)size;
+  (void)table;
+  (void)count;
+  (void)fn;
+  return JIT_EMPTY;
+}
+
+const uint8_t *jit_code_bytes(jit_fn fn)
+{
+  (void)fn;
+  return NULL;
+}
+
+void jit_link(uint16_t address, jit_fn fn, uint16_t length)
+{
+  (void)address;
+  (void)fn;
+  (void)length;
+}
+
+void jit_unlink(uint16_t address)
+{
+  (void)address;
+}
+
+void jit_reset()
+{
+}
+
+#endif
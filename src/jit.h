@@ -0,0 +1,101 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+// Native code for one block or trace of guest instructions. It runs with the
+// guest registers at reg, leaves PC at the next instruction to execute and
+// returns how many instructions it executed; the caller adds them to icount.
+// Traces that loop add each full pass to icount themselves and only start
+// another while the pass fits below limit.
+typedef uint32_t (*jit_fn)(uint16_t *reg, uint64_t limit);
+
+// Longest block compiled in one piece, and longest trace
+#define JIT_BLOCK_MAX 64
+#define JIT_TRACE_MAX 256
+
+// Executable memory for compiled blocks, reused from the start when full
+#define JIT_ARENA_SIZE (4 << 20)
+
+enum
+{
+  JIT_OK,
+  JIT_EMPTY, // The block starts with an instruction left to the other engines
+  JIT_FULL,  // The arena has no room, jit_reset() and try again
+};
+
+// Host addresses generated code refers to. Their positions are recorded so
+// that code saved by one process can be patched to run in another.
+enum
+{
+  JIT_SYM_MEMORY,
+  JIT_SYM_PAGE_CLASS,
+  JIT_SYM_ICOUNT,
+  JIT_SYM_READ,  // mem_read_slow
+  JIT_SYM_STORE, // Stores that may invalidate generated code
+  JIT_SYM_RETURNS,
+  JIT_SYM_LINKS,
+  JIT_SYM_COUNT,
+};
+
+struct jit_reloc
+{
+  uint32_t offset; // Of a 64-bit address in the code
+  uint32_t symbol;
+};
+
+struct jit_code
+{
+  jit_fn fn;
+  uint16_t length; // Most instructions the block can execute
+  uint16_t reloc_count;
+  uint32_t size; // Bytes of code at fn
+  struct jit_reloc *relocs; // malloc'd, only kept when jit_keep_relocs is set
+};
+
+// Returns 0 if this host cannot run generated code
+int jit_init(void);
+
+// Compile the block starting at address. On JIT_OK, length is the most
+// instructions the block can execute, which lets callers stop at an exact
+// instruction count by only entering blocks that fit. Several threads may
+// compile at once. The caller marks the pages PAGE_CODE beforehand so that
+// stores into the block reach it.
+int jit_compile(uint16_t address, struct jit_code *out);
+
+// Compile the count instructions at path as one straight line. path[count] is
+// where the recorded run went next; when it is path[0] the trace loops back
+// to its start in native code. Branches that leave the path exit the trace.
+// length is the most instructions one pass executes. The caller marks the
+// pages of every path address PAGE_CODE.
+int jit_compile_trace(const uint16_t *path, uint16_t count, struct jit_code *out);
+
+// Copy code saved from jit_compile() into the arena and patch its host
+// addresses. Returns JIT_EMPTY when the relocations do not fit the code.
+int jit_load(const uint8_t *code, uint32_t size, const struct jit_reloc *relocs, uint16_t count, jit_fn *fn);
+
+// The code bytes behind a compiled block
+const uint8_t *jit_code_bytes(jit_fn fn);
+
+// Forget all generated code
+void jit_reset(void);
+
+// Native code that RET may continue in directly. A JSR that leaves its block
+// pushes the return address onto a shadow stack along with the code linked
+// at that address, and a RET whose R7 matches the top of the stack jumps
+// straight into that code instead of going back to the caller of the block.
+// Code must be unlinked before it is dropped.
+void jit_link(uint16_t address, jit_fn fn, uint16_t length);
+void jit_unlink(uint16_t address);
+
+// Set when generated code is invalidated. Compiled stores leave their block
+// when one of them triggered it, as it may have been their own block.
+extern int jit_dropped;
+
+// Keep relocations of compiled blocks so they can be saved
+extern int jit_keep_relocs;
+
+// Identifies the code generator; saved code from another build is not used
+extern const char jit_build_id[];
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lc3.h"
+#include "jit.h"
+#include "jitcache.h"
+
+#define JITCACHE_MAGIC "LC3JIT1"
+
+struct file_header
+{
+  char magic[8];
+  char build[32];
+  uint64_t image_hash;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Followed by the guest words, the relocations and the code, padded to 8
+struct entry
+{
+  uint16_t address;
+  uint16_t length;
+  uint16_t reloc_count;
+  uint16_t reserved;
+  uint32_t size;  // Of the code
+  uint32_t bytes; // Of the whole entry
+  uint32_t check; // Of everything after the entry header
+  uint32_t reserved2;
+};
+
+int jitcache_enabled;
+
+static char dir_path[4096];
+static char file_path[4096];
+static uint64_t max_bytes;
+static uint64_t image_hash;
+
+static uint8_t *mapped;
+static size_t mapped_size;
+
+// Saved blocks by address, pointing into the mapped file or, for blocks
+// compiled in this run, to malloc'd entries
+static const struct entry *saved[MEMORY_MAX];
+static struct entry *added[MEMORY_MAX];
+static int changed;
+
+static const uint16_t *entry_words(const struct entry *e)
+{
+  return (const uint16_t *)(e + 1);
+}
+
+static const struct jit_reloc *entry_relocs(const struct entry *e)
+{
+  return (const struct jit_reloc *)(entry_words(e) + e->length + (e->length & 1));
+}
+
+static const uint8_t *entry_code(const struct entry *e)
+{
+  return (const uint8_t *)(entry_relocs(e) + e->reloc_count);
+}
+
+static uint32_t entry_bytes(uint16_t length, uint16_t reloc_count, uint32_t size)
+{
+  uint32_t bytes = sizeof(struct entry) + sizeof(uint16_t) * (length + (length & 1)) +
+                   sizeof(struct jit_reloc) * reloc_count + size;
+  return (bytes + 7) & ~7u;
+}
+
+// FNV-1a, a damaged file must not be run
+static uint32_t checksum(const struct entry *e)
+{
+  const uint8_t *p = (const uint8_t *)(e + 1);
+  uint32_t hash = 0x811C9DC5;
+  for (uint32_t i = 0; i < e->bytes - sizeof(*e); ++i)
+  {
+    hash = (hash ^ p[i]) * 0x01000193;
+  }
+  return hash;
+}
+
+static void build_id(char out[32])
+{
+  memset(out, 0, 32);
+  strncpy(out, jit_build_id, 31);
+}
+
+static void map_file()
+{
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0)
+  {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct file_header))
+  {
+    close(fd);
+    return;
+  }
+  uint8_t *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // Mark it used for the eviction order
+  futimens(fd, NULL);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    return;
+  }
+
+  const struct file_header *header = (const struct file_header *)data;
+  char build[32];
+  build_id(build);
+  if (memcmp(header->magic, JITCACHE_MAGIC, sizeof(header->magic)) ||
+      memcmp(header->build, build, sizeof(build)) || header->image_hash != image_hash)
+  {
+    // From another build or image, overwritten at exit
+    munmap(data, (size_t)st.st_size);
+    changed = 1;
+    return;
+  }
+  mapped = data;
+  mapped_size = (size_t)st.st_size;
+
+  size_t at = sizeof(*header);
+  for (uint32_t i = 0; i < header->count; ++i)
+  {
+    if (mapped_size - at < sizeof(struct entry))
+    {
+      break;
+    }
+    const struct entry *e = (const struct entry *)(mapped + at);
+    if (e->length == 0 || e->length > JIT_BLOCK_MAX || e->size > mapped_size || e->bytes > mapped_size - at ||
+        e->bytes < entry_bytes(e->length, e->reloc_count, e->size) || e->check != checksum(e))
+    {
+      changed = 1;
+      break;
+    }
+    saved[e->address] = e;
+    at += e->bytes;
+  }
+}
+
+int jitcache_open(const char *dir, uint64_t max)
+{
+  if (mkdir(dir, 0755) != 0 && access(dir, W_OK) != 0)
+  {
+    return 0;
+  }
+  // FNV-1a over the loaded images
+  image_hash = 0xCBF29CE484222325ull;
+  const uint8_t *bytes = (const uint8_t *)memory;
+  for (size_t i = 0; i < sizeof(memory); ++i)
+  {
+    image_hash = (image_hash ^ bytes[i]) * 0x100000001B3ull;
+  }
+  snprintf(dir_path, sizeof(dir_path), "%s", dir);
+  snprintf(file_path, sizeof(file_path), "%s/%016llx.jit", dir, (unsigned long long)image_hash);
+  max_bytes = max;
+  map_file();
+  jit_keep_relocs = 1;
+  jitcache_enabled = 1;
+  return 1;
+}
+
+static const struct entry *lookup(uint16_t address)
+{
+  return added[address] ? added[address] : saved[address];
+}
+
+int jitcache_has(uint16_t address)
+{
+  return lookup(address) != NULL;
+}
+
+static void forget(uint16_t address)
+{
+  free(added[address]);
+  added[address] = NULL;
+  saved[address] = NULL;
+  changed = 1;
+}
+
+int jitcache_load(uint16_t address, struct jit_code *out)
+{
+  const struct entry *e = lookup(address);
+  const uint16_t *words = entry_words(e);
+  for (uint16_t i = 0; i < e->length; ++i)
+  {
+    uint16_t at = address + i;
+    if (memory[at] != words[i] || (page_class[at >> PAGE_SHIFT] & PAGE_MMIO))
+    {
+      forget(address);
+      return JIT_EMPTY;
+    }
+  }
+  int result = jit_load(entry_code(e), e->size, entry_relocs(e), e->reloc_count, &out->fn);
+  if (result == JIT_EMPTY)
+  {
+    forget(address);
+    return JIT_EMPTY;
+  }
+  out->length = e->length;
+  out->size = e->size;
+  out->reloc_count = 0;
+  out->relocs = NULL;
+  return result;
+}
+
+void jitcache_add(uint16_t address, const struct jit_code *code)
+{
+  if (!code->relocs && code->reloc_count)
+  {
+    return;
+  }
+  uint32_t bytes = entry_bytes(code->length, code->reloc_count, code->size);
+  struct entry *e = calloc(1, bytes);
+  if (!e)
+  {
+    return;
+  }
+  e->address = address;
+  e->length = code->length;
+  e->reloc_count = code->reloc_count;
+  e->size = code->size;
+  e->bytes = bytes;
+  uint16_t *words = (uint16_t *)(e + 1);
+  for (uint16_t i = 0; i < code->length; ++i)
+  {
+    words[i] = memory[(uint16_t)(address + i)];
+  }
+  memcpy((void *)entry_relocs(e), code->relocs, sizeof(*code->relocs) * code->reloc_count);
+  memcpy((void *)entry_code(e), jit_code_bytes(code->fn), code->size);
+  e->check = checksum(e);
+  free(added[address]);
+  added[address] = e;
+  changed = 1;
+}
+
+static int write_all(int fd, const void *data, size_t n)
+{
+  const uint8_t *p = data;
+  while (n > 0)
+  {
+    ssize_t done = write(fd, p, n);
+    if (done <= 0)
+    {
+      return 0;
+    }
+    p += done;
+    n -= (size_t)done;
+  }
+  return 1;
+}
+
+struct cache_file
+{
+  char name[256];
+  off_t size;
+  struct timespec used;
+};
+
+static int oldest_first(const void *a, const void *b)
+{
+  const struct cache_file *x = a, *y = b;
+  if (x->used.tv_sec != y->used.tv_sec)
+  {
+    return (x->used.tv_sec > y->used.tv_sec) - (x->used.tv_sec < y->used.tv_sec);
+  }
+  return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+static void evict()
+{
+  DIR *d = opendir(dir_path);
+  if (!d)
+  {
+    return;
+  }
+  struct cache_file *files = NULL;
+  size_t count = 0, room = 0;
+  uint64_t total = 0;
+  struct dirent *de;
+  char path[4096 + 256];
+  while ((de = readdir(d)))
+  {
+    size_t n = strlen(de->d_name);
+    if (n < 4 || n >= sizeof(files->name) || strcmp(de->d_name + n - 4, ".jit"))
+    {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      continue;
+    }
+    if (count == room)
+    {
+      room = room ? room * 2 : 16;
+      struct cache_file *grown = realloc(files, sizeof(*files) * room);
+      if (!grown)
+      {
+        break;
+      }
+      files = grown;
+    }
+    memcpy(files[count].name, de->d_name, n + 1);
+    files[count].size = st.st_size;
+    files[count].used = st.st_mtim;
+    total += (uint64_t)st.st_size;
+    ++count;
+  }
+  closedir(d);
+
+  qsort(files, count, sizeof(*files), oldest_first);
+  for (size_t i = 0; i < count && total > max_bytes; ++i)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir_path, files[i].name);
+    if (unlink(path) == 0)
+    {
+      total -= (uint64_t)files[i].size;
+    }
+  }
+  free(files);
+}
+
+void jitcache_save()
+{
+  if (!jitcache_enabled)
+  {
+    return;
+  }
+  if (changed)
+  {
+    struct file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JITCACHE_MAGIC, sizeof(header.magic));
+    build_id(header.build);
+    header.image_hash = image_hash;
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+      header.count += lookup(a) != NULL;
+    }
+
+    // Written aside and renamed so readers never see half a file
+    char temp[sizeof(file_path) + 16];
+    snprintf(temp, sizeof(temp), "%s.%d", file_path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      return;
+    }
+    int ok = write_all(fd, &header, sizeof(header));
+    for (uint32_t a = 0; a < MEMORY_MAX && ok; ++a)
+    {
+      const struct entry *e = lookup(a);
+      if (e)
+      {
+        ok = write_all(fd, e, e->bytes);
+      }
+    }
+    close(fd);
+    if (!ok || rename(temp, file_path) != 0)
+    {
+      unlink(temp);
+      return;
+    }
+  }
+  evict();
+}
@@ -0,0 +1,36 @@
+#ifndef JITCACHE_H
+#define JITCACHE_H
+
+#include <stdint.h>
+
+#include "jit.h"
+
+// Default bound on the total size of a cache directory
+#define JITCACHE_MAX (64 << 20)
+
+// Generated code kept across runs. Blocks compiled for an image are saved to
+// DIR/<image hash>.jit with their guest words and relocations, and the next
+// run of the same image with the same build loads them on first entry
+// instead of waiting for them to get hot and compiling them again.
+extern int jitcache_enabled;
+
+// Called once the images are loaded. Missing or mismatched cache files are
+// ignored. Returns 0 if the directory cannot be used.
+int jitcache_open(const char *dir, uint64_t max);
+
+// Nonzero if a saved block may exist for address
+int jitcache_has(uint16_t address);
+
+// Load the saved block at address if its guest words still match memory.
+// Returns JIT_EMPTY (and forgets the block) when they do not, JIT_FULL when
+// the arena has no room.
+int jitcache_load(uint16_t address, struct jit_code *out);
+
+// Remember a newly compiled block, its relocations must have been kept
+void jitcache_add(uint16_t address, const struct jit_code *code);
+
+// Write the cache file, then delete the least recently used files in the
+// directory until it fits the size bound
+void jitcache_save(void);
+
+#endif
@@ -2,80 +2,42 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <time.h>
 
-// Memory mapped registers
-enum
-{
-  MR_KBSR = 0xFE00,
-  MR_KBDR = 0xFE02
-};
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define READ_STRING_SSE2 1
+#include <emmintrin.h>
+#endif
 
-// TRAP Codes
-enum
-{
-  TRAP_GETC = 0x20,
-  TRAP_OUT = 0x21,
-  TRAP_PUTS = 0x22,
-  TRAP_IN = 0x23,
-  TRAP_PUTSP = 0x24,
-  TRAP_HALT = 0x25
-};
-
-// Registers (8 General Purpose (R0-R7), Program Counter (PC) and Condition Flag (COND)
-enum
-{
-  R_R0 = 0,
-  R_R1,
-  R_R2,
-  R_R3,
-  R_R4,
-  R_R5,
-  R_R6,
-  R_R7,
-  R_PC,
-  R_COND,
-  R_COUNT
-};
-
-// Defining memory
-#define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];
-uint16_t reg[R_COUNT];
+#include "lc3.h"
+#include "debugger.h"
+#include "difftest.h"
+#include "predecode.h"
+#include "gdbstub.h"
+#include "screen.h"
+#include "capture.h"
+#include "stats.h"
+#include "profile.h"
+#include "tier.h"
+#include "jitcache.h"
+#include "smp.h"
+#include "chan.h"
+#include "timer.h"
+#include "heatmap.h"
 
-// Conditional flags
-enum
-{
-  FL_POS = 1 << 0,
-  FL_ZRO = 1 << 1,
-  FL_NEG = 1 << 2,
-};
+uint16_t memory[MEMORY_MAX];
+_Thread_local uint16_t reg[R_COUNT];
 
-// Instruction Set (Opcodes)
-enum
-{
-  OP_BR = 0,
-  OP_ADD,
-  OP_LD,
-  OP_ST,
-  OP_JSR,
-  OP_AND,
-  OP_LDR,
-  OP_STR,
-  OP_RTI,
-  OP_NOT,
-  OP_LDI,
-  OP_STI,
-  OP_JMP,
-  OP_RES,
-  OP_LEA,
-  OP_TRAP,
-};
+_Thread_local int running = 1;
+_Thread_local uint64_t icount;
 
 // Enable/Disable buffer
 struct termios original_tio;
@@ -93,7 +55,7 @@ void restore_input_buffering()
   tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
 }
 
-uint16_t check_key()
+int check_key()
 {
   fd_set readfds;
   FD_ZERO(&readfds);
@@ -102,13 +64,105 @@ uint16_t check_key()
   struct timeval timeout;
   timeout.tv_sec = 0;
   timeout.tv_usec = 0;
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
+  return select(1, &readfds, NULL, NULL, &timeout) > 0;
+}
+
+// Block until stdin is readable. select() returns early for any signal,
+// unlike a read under SA_RESTART, so a SIGUSR1 dump is not held up by a
+// guest waiting for a key.
+static void wait_key()
+{
+  for (;;)
+  {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+    if (select(1, &readfds, NULL, NULL, NULL) > 0 || errno != EINTR)
+    {
+      return;
+    }
+    if (vm_interrupted)
+    {
+      vm_quit();
+    }
+    if (dump_requested)
+    {
+      dump_requested = 0;
+      dump_state();
+    }
+  }
+}
+
+int read_key()
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (stats_enabled)
+  {
+    stats_publish(STATS_BLOCKED);
+  }
+  wait_key();
+  int c = getchar();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  counters.input_wait_ns += (uint64_t)((int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec));
+  if (stats_enabled)
+  {
+    stats_publish(STATS_RUNNING);
+  }
+  return c;
+}
+
+volatile sig_atomic_t vm_interrupted;
+
+// Save what outlives the run and give the terminal back
+static void vm_finish()
+{
+  jitcache_save();
+  if (capture_enabled)
+  {
+    capture_flush();
+  }
+  if (screen_enabled)
+  {
+    screen_flush();
+  }
+  restore_input_buffering();
+}
+
+void vm_quit()
+{
+  vm_finish();
+  printf("\n");
+  exit(-2);
 }
 
 // Handle interrupt
 void handle_interrupt(int signal)
 {
+  (void)signal;
+  if (debug_enabled)
+  {
+    // Return to the debugger prompt instead of killing the session
+    debug_interrupted = 1;
+    return;
+  }
+  if (!vm_interrupted)
+  {
+    // Leave through vm_quit() at the next slice or key wait, where the JIT
+    // cache is not half updated
+    vm_interrupted = 1;
+    return;
+  }
+  // Again, with the guest stuck somewhere that does not look
   restore_input_buffering();
+  if (capture_enabled)
+  {
+    capture_flush();
+  }
+  if (screen_enabled)
+  {
+    screen_flush();
+  }
   printf("\n");
   exit(-2);
 }
@@ -177,271 +231,860 @@ int read_image(const char *image_path)
 }
 
 // Memory access
-void mem_write(uint16_t address, uint16_t value)
+uint8_t page_class[PAGE_COUNT] = {[MR_KBSR >> PAGE_SHIFT] = PAGE_MMIO};
+
+// Store on behalf of the guest or a device, keeping the caches that depend on
+// memory contents up to date
+static void store(uint16_t address, uint16_t value)
 {
+  uint8_t cls = page_class[address >> PAGE_SHIFT];
+  if (cls & PAGE_TRACK)
+  {
+    debug_track_write(address);
+  }
+  if (cls & PAGE_CODE)
+  {
+    predecode_invalidate(address);
+    tier_invalidate(address);
+  }
   memory[address] = value;
 }
 
-uint16_t mem_read(uint16_t address)
+void mem_write_slow(uint16_t address, uint16_t value)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_PROFILE)
+  {
+    heatmap_write(address);
+  }
+  if (page_class[address >> PAGE_SHIFT] & PAGE_WATCH_WRITE)
+  {
+    debug_watch_write(address, value);
+  }
+  if (address >= MR_CORE_ID && address <= MR_ATOMIC_ADD)
+  {
+    smp_write(address, value);
+    return;
+  }
+  if (address >= MR_RXSR && address <= MR_TXDR)
+  {
+    chan_write(address, value);
+    return;
+  }
+  if (address >= MR_CLOCK && address <= MR_SLEEP_HI)
+  {
+    timer_write(address, value);
+    return;
+  }
+  store(address, value);
+}
+
+uint16_t mem_read_slow(uint16_t address)
 {
+  if (page_class[address >> PAGE_SHIFT] & PAGE_PROFILE)
+  {
+    heatmap_read(address);
+  }
+  if (page_class[address >> PAGE_SHIFT] & PAGE_WATCH_READ)
+  {
+    debug_watch_read(address);
+  }
+  if (address >= MR_CORE_ID && address <= MR_ATOMIC_ADD)
+  {
+    return smp_read(address);
+  }
+  if (address >= MR_RXSR && address <= MR_TXDR)
+  {
+    return chan_read(address);
+  }
+  if (address >= MR_CLOCK && address <= MR_SLEEP_HI)
+  {
+    return timer_read(address);
+  }
   if (address == MR_KBSR)
   {
-    if (check_key())
+    smp_lock();
+    ++counters.kbsr_polls;
+    if (input_poll())
     {
-      memory[MR_KBSR] = (1 << 15);
-      memory[MR_KBDR] = getchar();
+      store(MR_KBSR, 1 << 15);
+      store(MR_KBDR, input_getc());
     }
     else
     {
-      memory[MR_KBSR] = 0;
+      store(MR_KBSR, 0);
     }
+    // Another core may poll as soon as the console is free
+    uint16_t status = memory[MR_KBSR];
+    smp_unlock();
+    return status;
   }
   return memory[address];
 }
 
+// Guest console
+int input_poll()
+{
+  if (difftest_enabled)
+  {
+    return difftest_key_ready();
+  }
+  int ready = debug_enabled ? debug_input(check_key) : check_key();
+  if (!ready && screen_enabled)
+  {
+    // The guest is idling until a key arrives, so the frame is complete
+    screen_flush();
+  }
+  return ready;
+}
 
-int main(int argc, const char *argv[])
+int input_getc()
 {
-  if (argc < 2)
+  if (difftest_enabled)
   {
-    printf("lc3 [image file] ...\n");
-    exit(2);
-    ;
+    return difftest_getc();
   }
-  signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
+  if (screen_enabled)
+  {
+    screen_flush();
+  }
+  if (debug_enabled)
+  {
+    return debug_input(read_key);
+  }
+  return read_key();
+}
 
-  for (int arg = 1; arg < argc; ++arg)
+void output_putc(char c)
+{
+  if (debug_enabled && debug_replaying())
+  {
+    return;
+  }
+  ++counters.bytes_out;
+  if (capture_enabled)
   {
-    if (!read_image(argv[arg]))
+    capture_putc(c);
+    return;
+  }
+  if (screen_enabled)
+  {
+    screen_putc(c);
+    return;
+  }
+  putc(c, stdout);
+}
+
+void output_write(const char *data, size_t n)
+{
+  if (debug_enabled && debug_replaying())
+  {
+    return;
+  }
+  counters.bytes_out += n;
+  if (capture_enabled)
+  {
+    capture_write(data, n);
+    return;
+  }
+  if (screen_enabled)
+  {
+    for (size_t i = 0; i < n; ++i)
     {
-      printf("failed to load image: %s\n", argv[arg]);
-      exit(1);
+      screen_putc(data[i]);
     }
+    return;
   }
+  // Anything still in stdio goes first, then the string in a single write
+  fflush(stdout);
+  size_t done = 0;
+  while (done < n)
+  {
+    ssize_t written = write(STDOUT_FILENO, data + done, n - done);
+    if (written <= 0)
+    {
+      break;
+    }
+    done += (size_t)written;
+  }
+}
 
-  // Setup
-  reg[R_COND] = FL_ZRO;
-
-  enum
+void output_flush()
+{
+  if (capture_enabled)
   {
-    PC_START = 0x3000
-  };
-  reg[R_PC] = PC_START;
+    // Drained when the buffer fills and at HALT
+    return;
+  }
+  if (screen_enabled)
+  {
+    screen_flush_due();
+    return;
+  }
+  fflush(stdout);
+}
 
-  int running = 1;
+// Guest strings
+// PUTS and PUTSP read straight from memory[] without device side effects.
+// The address wraps at 0xFFFF and a string without a terminator stops after
+// one pass over memory. PUTSP yields up to two bytes per word, plus slack
+// for the 16-byte vector stores.
+static char text[MEMORY_MAX * 2 + 16];
 
-  while (running)
+// Scalar reference, also used for the words a vector chunk cannot take
+static size_t read_words(uint16_t address, uint32_t count, int packed, size_t n, int *done)
+{
+  for (uint32_t i = 0; i < count; ++i)
   {
-    uint16_t instr = mem_read(reg[R_PC]++);
-    uint16_t opcode = instr >> 12;
-    switch (opcode)
+    uint16_t word = memory[(uint16_t)(address + i)];
+    if (!word)
     {
-    case OP_ADD:
+      *done = 1;
+      return n;
+    }
+    text[n++] = (char)(word & 0xFF);
+    if (packed && (word >> 8))
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t r1 = (instr >> 6) & 0x7;
-      uint16_t imm_flag = (instr >> 5) & 0x1;
+      text[n++] = (char)(word >> 8);
+    }
+  }
+  return n;
+}
 
-      if (imm_flag)
-      {
-        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
-      }
-      else
-      {
-        uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
-      }
-      update_flags(r0);
+#if READ_STRING_SSE2
+// Eight words per step. PUTS keeps the low byte of each word; PUTSP relies
+// on memory[] being little-endian, so the chunk already is the byte stream
+// unless a word before the terminator has a zero high byte.
+static size_t read_string(uint16_t address, int packed)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low = _mm_set1_epi16(0xFF);
+  uint32_t left = MEMORY_MAX;
+  size_t n = 0;
+  int done = 0;
+
+  while (left && !done)
+  {
+    // Vector loads must not run past the end of memory[]
+    if (left < 8 || address > MEMORY_MAX - 8)
+    {
+      uint32_t count = (uint32_t)(MEMORY_MAX - address);
+      count = count < left ? count : left;
+      count = count < 8 ? count : 8;
+      n = read_words(address, count, packed, n, &done);
+      address += count;
+      left -= count;
+      continue;
     }
-    break;
-    case OP_AND:
+    __m128i words = _mm_loadu_si128((const __m128i *)(memory + address));
+    unsigned terminator = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(words, zero));
+    unsigned valid = terminator ? (1u << __builtin_ctz(terminator)) - 1 : 0xFFFF;
+    if (!packed)
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t r1 = (instr >> 6) & 0x7;
-      uint16_t imm_flag = (instr >> 5) & 0x1;
-
-      if (imm_flag)
+      _mm_storel_epi64((__m128i *)(text + n), _mm_packus_epi16(_mm_and_si128(words, low), zero));
+      n += __builtin_popcount(valid) / 2;
+    }
+    else
+    {
+      unsigned high_zero = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(words, zero)) & 0xAAAA & valid;
+      if (high_zero)
       {
-        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] & imm5;
+        n = read_words(address, 8, packed, n, &done);
       }
       else
       {
-        uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] & reg[r2];
+        _mm_storeu_si128((__m128i *)(text + n), words);
+        n += __builtin_popcount(valid);
       }
-      update_flags(r0);
     }
-    break;
-    case OP_NOT:
+    done |= terminator != 0;
+    address += 8;
+    left -= 8;
+  }
+  return n;
+}
+#else
+static size_t read_string(uint16_t address, int packed)
+{
+  int done = 0;
+  return read_words(address, MEMORY_MAX, packed, 0, &done);
+}
+#endif
+
+// read_string() takes the words straight from memory[], so --heatmap counts
+// them here, up to and including the terminator
+static void heatmap_string(uint16_t address)
+{
+  if (!heatmap_enabled)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < MEMORY_MAX; ++i)
+  {
+    uint16_t a = (uint16_t)(address + i);
+    heatmap_read(a);
+    if (!memory[a])
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t r1 = (instr >> 6) & 0x7;
+      break;
+    }
+  }
+}
 
-      reg[r0] = ~reg[r1];
-      update_flags(r0);
+// Execute a single instruction whose word has already been fetched
+void execute(uint16_t instr)
+{
+  uint16_t opcode = instr >> 12;
+  switch (opcode)
+  {
+  case OP_ADD:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    if (imm_flag)
+    {
+      uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+      reg[r0] = reg[r1] + imm5;
     }
-    break;
-    case OP_BR:
+    else
     {
-      uint16_t cond_flag = instr >> 9;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-      if (cond_flag & reg[R_COND])
-      {
-        reg[R_PC] += pc_offset;
-      }
+      uint16_t r2 = instr & 0x7;
+      reg[r0] = reg[r1] + reg[r2];
     }
-    break;
-    case OP_JMP:
+    update_flags(r0);
+  }
+  break;
+  case OP_AND:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    if (imm_flag)
     {
-      uint16_t r1 = (instr >> 6) & 0x7;
-      reg[R_PC] = reg[r1];
+      uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+      reg[r0] = reg[r1] & imm5;
     }
-    break;
-    case OP_JSR:
+    else
     {
-      reg[R_R7] = reg[R_PC];
-      uint16_t flag = (instr >> 11) & 0x1;
-      if (flag)
-      {
-        uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
-        reg[R_PC] += pc_offset;
-      }
-      else
-      {
-        uint16_t r1 = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[r1];
-      }
+      uint16_t r2 = instr & 0x7;
+      reg[r0] = reg[r1] & reg[r2];
     }
-    break;
-    case OP_LD:
+    update_flags(r0);
+  }
+  break;
+  case OP_NOT:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+
+    reg[r0] = ~reg[r1];
+    update_flags(r0);
+  }
+  break;
+  case OP_BR:
+  {
+    uint16_t cond_flag = instr >> 9;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    if (cond_flag & reg[R_COND])
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-      reg[r0] = mem_read(reg[R_PC] + pc_offset);
-      update_flags(r0);
+      reg[R_PC] += pc_offset;
     }
-    break;
-    case OP_LDI:
+  }
+  break;
+  case OP_JMP:
+  {
+    uint16_t r1 = (instr >> 6) & 0x7;
+    reg[R_PC] = reg[r1];
+  }
+  break;
+  case OP_JSR:
+  {
+    reg[R_R7] = reg[R_PC];
+    uint16_t flag = (instr >> 11) & 0x1;
+    if (flag)
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-      reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-      update_flags(r0);
+      uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
+      reg[R_PC] += pc_offset;
     }
-    break;
-    case OP_LDR:
+    else
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
       uint16_t r1 = (instr >> 6) & 0x7;
-      uint16_t offset = sign_extend(instr & 0x3F, 6);
-      reg[r0] = mem_read(reg[r1] + offset);
-      update_flags(r0);
+      reg[R_PC] = reg[r1];
     }
-    break;
-    case OP_LEA:
+  }
+  break;
+  case OP_LD:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    reg[r0] = mem_read(reg[R_PC] + pc_offset);
+    update_flags(r0);
+  }
+  break;
+  case OP_LDI:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+
+    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
+    update_flags(r0);
+  }
+  break;
+  case OP_LDR:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+    uint16_t offset = sign_extend(instr & 0x3F, 6);
+    reg[r0] = mem_read(reg[r1] + offset);
+    update_flags(r0);
+  }
+  break;
+  case OP_LEA:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    reg[r0] = reg[R_PC] + pc_offset;
+    update_flags(r0);
+  }
+  break;
+  case OP_ST:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    mem_write(reg[R_PC] + pc_offset, reg[r0]);
+  }
+  break;
+  case OP_STI:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+  }
+  break;
+  case OP_STR:
+  {
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+    uint16_t offset = sign_extend(instr & 0x3F, 6);
+    mem_write(reg[r1] + offset, reg[r0]);
+  }
+  break;
+  case OP_TRAP:
+  {
+    reg[R_R7] = reg[R_PC];
+
+    uint8_t vector = instr & 0xFF;
+    smp_lock();
+    if (vector >= TRAP_GETC && vector < TRAP_GETC + 8)
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-      reg[r0] = reg[R_PC] + pc_offset;
-      update_flags(r0);
+      ++counters.traps[vector - TRAP_GETC];
     }
-    break;
-    case OP_ST:
+    switch (vector)
+    {
+    case TRAP_GETC:
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-      mem_write(reg[R_PC] + pc_offset, reg[r0]);
+      reg[R_R0] = (uint16_t)input_getc();
+      update_flags(R_R0);
     }
     break;
-    case OP_STI:
+    case TRAP_OUT:
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-      mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+      output_putc((char)reg[R_R0]);
+      output_flush();
     }
     break;
-    case OP_STR:
+    case TRAP_PUTS:
     {
-      uint16_t r0 = (instr >> 9) & 0x7;
-      uint16_t r1 = (instr >> 6) & 0x7;
-      uint16_t offset = sign_extend(instr & 0x3F, 6);
-      mem_write(reg[r1] + offset, reg[r0]);
+      size_t n = read_string(reg[R_R0], 0);
+      heatmap_string(reg[R_R0]);
+      output_write(text, n);
+      output_flush();
     }
     break;
-    case OP_TRAP:
+    case TRAP_IN:
     {
-      reg[R_R7] = reg[R_PC];
-
-      switch (instr & 0xFF)
-      {
-      case TRAP_GETC:
-      {
-        reg[R_R0] = (uint16_t)getchar();
-        update_flags(R_R0);
-      }
-      break;
-      case TRAP_OUT:
+      const char *prompt = "Enter a character: ";
+      while (*prompt)
       {
-        putc((char)reg[R_R0], stdout);
-        fflush(stdout);
+        output_putc(*prompt++);
       }
-      break;
-      case TRAP_PUTS:
-      {
-        uint16_t *c = memory + reg[R_R0];
-        while (*c)
-        {
-          putc((char)*c, stdout);
-          ++c;
-        }
-        fflush(stdout);
-      }
-      break;
-      case TRAP_IN:
+      output_flush();
+      char c = input_getc();
+      output_putc(c);
+      output_flush();
+      reg[R_R0] = (uint16_t)c;
+      update_flags(R_R0);
+    }
+    break;
+    case TRAP_PUTSP:
+    {
+      size_t n = read_string(reg[R_R0], 1);
+      heatmap_string(reg[R_R0]);
+      output_write(text, n);
+      output_flush();
+    }
+    break;
+    case TRAP_HALT:
+    {
+      const char *msg = "HALT\n";
+      while (*msg)
       {
-        printf("Enter a character: ");
-        char c = getchar();
-        putc(c, stdout);
-        fflush(stdout);
-        reg[R_R0] = (uint16_t)c;
-        update_flags(R_R0);
+        output_putc(*msg++);
       }
-      break;
-      case TRAP_PUTSP:
+      output_flush();
+      if (capture_enabled)
       {
-        uint16_t *c = memory + reg[R_R0];
-        while (*c)
-        {
-          char char1 = (*c) & 0xFF;
-          putc(char1, stdout);
-          char char2 = (*c) >> 8;
-          if (char2)
-            putc(char2, stdout);
-          ++c;
-        }
-        fflush(stdout);
+        capture_flush();
       }
-      break;
-      case TRAP_HALT:
+      else if (screen_enabled)
       {
-        puts("HALT");
-        fflush(stdout);
-        running = 0;
-      }
-      break;
+        screen_flush();
       }
+      running = 0;
     }
     break;
-    case OP_RES:
-    case OP_RTI:
-    default:
-      abort();
     }
+    smp_unlock();
   }
-  restore_input_buffering();
+  break;
+  case OP_RES:
+  case OP_RTI:
+  default:
+    abort();
+  }
+}
+
+// Fetch and execute the instruction at PC
+void step()
+{
+  uint16_t instr = mem_read(reg[R_PC]++);
+  ++icount;
+  execute(instr);
+}
+
+// Runs between slices of guest execution
+void vm_tick()
+{
+  if (dump_requested)
+  {
+    dump_requested = 0;
+    dump_state();
+  }
+  if (stats_enabled)
+  {
+    stats_publish(running ? STATS_RUNNING : STATS_HALTED);
+  }
+  if (screen_enabled)
+  {
+    // Output followed by a long stretch without I/O still shows up
+    smp_lock();
+    screen_flush_due();
+    smp_unlock();
+  }
+}
+
+static void usage()
+{
+  printf("lc3 [options] [image file] ...\n");
+  printf("  -d, --debug                  run under the interactive debugger\n");
+  printf("  --checkpoint-interval N      instructions between debugger checkpoints (default %d)\n",
+         DEBUG_CHECKPOINT_INTERVAL);
+  printf("  --gdb PATH|:PORT             serve the gdb remote protocol on a Unix socket or loopback port\n");
+  printf("  --screen                     render output through a virtual screen, sending only changed cells\n");
+  printf("  --capture FILE|-             buffer all output in memory and write it to FILE only when full or at exit\n");
+  printf("  --capture-max N              stop capturing after N bytes and note the truncation\n");
+  printf("  --stats                      publish live counters in /dev/shm/lc3-PID for lc3-top\n");
+  printf("  --dump-file PATH             append the SIGUSR1 state dump to PATH instead of stderr\n");
+  printf("  --predecode-after N          block entries before the predecoded engine takes over (default %d, 0 never)\n",
+         TIER_PREDECODE_AFTER);
+  printf("  --jit-after N                block entries before a block is compiled to native code (default %d, 0 never)\n",
+         TIER_JIT_AFTER);
+  printf("  --trace-after N              backward branches to a loop before it is compiled as a trace (default %d, 0 never)\n",
+         TIER_TRACE_AFTER);
+  printf("  --cgen-after N               trace entries before its region is rebuilt through gcc (default 0, never)\n");
+  printf("  --jit-sync                   compile on the VM thread instead of a background thread\n");
+  printf("  --jit-cache DIR              keep generated code in DIR across runs of the same image\n");
+  printf("  --jit-cache-max N            bytes DIR may hold before the least recently used files go (default %d)\n",
+         JITCACHE_MAX);
+  printf("  --chan-in NAME               read the MR_RXDR channel NAME, written by another VM\n");
+  printf("  --chan-out NAME              write the MR_TXDR channel NAME, read by another VM\n");
+  printf("  --mhz N                      hold the guest to N million instructions per second\n");
+  printf("  --smp N                      run the image on N cores sharing memory, in the interpreter (max %d)\n",
+         SMP_CORES_MAX);
+  printf("  --heatmap PREFIX             count accesses per word in the interpreter, written to PREFIX.csv, .ppm and .txt\n");
+  printf("  --profile                    sample the guest PC %d times per CPU second for the dump; in\n"
+         "                               generated code a sample counts at the entry of its block or trace\n",
+         PROFILE_HZ);
+  printf("  --diff A,B                   run the image in two of interp, predecode, jit, trace and cgen and compare\n");
+  printf("  --diff-every N               instructions between comparisons (default %d)\n", DIFFTEST_EVERY);
+  printf("  --diff-max N                 stop comparing after N instructions (default 0, never)\n");
+  printf("  --diff-input FILE            keyboard input for both engines\n");
+  printf("  --diff-exhaustive            compare every instruction word from random states instead of an image\n");
+  printf("  --diff-states N              random states per word in exhaustive mode (default %d)\n", DIFFTEST_STATES);
+  printf("  --diff-seed N                seed for exhaustive mode\n");
+}
+
+int main(int argc, const char *argv[])
+{
+  int debug = 0;
+  const char *gdb = NULL;
+  int screen = 0;
+  const char *capture = NULL;
+  uint64_t capture_max = 0;
+  int stats = 0;
+  const char *dump_file = NULL;
+  int profile = 0;
+  uint32_t predecode_after = TIER_PREDECODE_AFTER;
+  uint32_t jit_after = TIER_JIT_AFTER;
+  uint32_t trace_after = TIER_TRACE_AFTER;
+  uint32_t cgen_after = 0;
+  int jit_sync = 0;
+  const char *jit_cache = NULL;
+  uint64_t jit_cache_max = JITCACHE_MAX;
+  uint64_t checkpoint_interval = DEBUG_CHECKPOINT_INTERVAL;
+  struct difftest_options diff = {.every = DIFFTEST_EVERY, .states = DIFFTEST_STATES, .seed = 1};
+  int images = 0;
+  int cores = 1;
+  double mhz = 0;
+  const char *heatmap = NULL;
+  const char *chan_in = NULL;
+  const char *chan_out = NULL;
+
+  for (int arg = 1; arg < argc; ++arg)
+  {
+    if (!strcmp(argv[arg], "-d") || !strcmp(argv[arg], "--debug"))
+    {
+      debug = 1;
+    }
+    else if (!strcmp(argv[arg], "--checkpoint-interval") && arg + 1 < argc)
+    {
+      checkpoint_interval = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--gdb") && arg + 1 < argc)
+    {
+      gdb = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--screen"))
+    {
+      screen = 1;
+    }
+    else if (!strcmp(argv[arg], "--capture") && arg + 1 < argc)
+    {
+      capture = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--capture-max") && arg + 1 < argc)
+    {
+      capture_max = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--stats"))
+    {
+      stats = 1;
+    }
+    else if (!strcmp(argv[arg], "--dump-file") && arg + 1 < argc)
+    {
+      dump_file = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--profile"))
+    {
+      profile = 1;
+    }
+    else if (!strcmp(argv[arg], "--predecode-after") && arg + 1 < argc)
+    {
+      predecode_after = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--jit-after") && arg + 1 < argc)
+    {
+      jit_after = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--trace-after") && arg + 1 < argc)
+    {
+      trace_after = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--cgen-after") && arg + 1 < argc)
+    {
+      cgen_after = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--jit-sync"))
+    {
+      jit_sync = 1;
+    }
+    else if (!strcmp(argv[arg], "--jit-cache") && arg + 1 < argc)
+    {
+      jit_cache = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--jit-cache-max") && arg + 1 < argc)
+    {
+      jit_cache_max = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--chan-in") && arg + 1 < argc)
+    {
+      chan_in = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--chan-out") && arg + 1 < argc)
+    {
+      chan_out = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--heatmap") && arg + 1 < argc)
+    {
+      heatmap = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--mhz") && arg + 1 < argc)
+    {
+      mhz = strtod(argv[++arg], NULL);
+    }
+    else if (!strcmp(argv[arg], "--smp") && arg + 1 < argc)
+    {
+      cores = atoi(argv[++arg]);
+    }
+    else if (!strcmp(argv[arg], "--diff") && arg + 1 < argc)
+    {
+      diff.engines = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--diff-every") && arg + 1 < argc)
+    {
+      diff.every = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--diff-max") && arg + 1 < argc)
+    {
+      diff.max = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--diff-input") && arg + 1 < argc)
+    {
+      diff.input = argv[++arg];
+    }
+    else if (!strcmp(argv[arg], "--diff-exhaustive"))
+    {
+      diff.exhaustive = 1;
+    }
+    else if (!strcmp(argv[arg], "--diff-states") && arg + 1 < argc)
+    {
+      diff.states = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    }
+    else if (!strcmp(argv[arg], "--diff-seed") && arg + 1 < argc)
+    {
+      diff.seed = strtoull(argv[++arg], NULL, 0);
+    }
+    else if (argv[arg][0] == '-')
+    {
+      usage();
+      exit(2);
+    }
+    else if (!read_image(argv[arg]))
+    {
+      printf("failed to load image: %s\n", argv[arg]);
+      exit(1);
+    }
+    else
+    {
+      ++images;
+    }
+  }
+  if ((images == 0 && !(diff.engines && diff.exhaustive)) || checkpoint_interval == 0 || diff.every == 0 ||
+      cores < 1 || cores > SMP_CORES_MAX || mhz < 0 || (cores > 1 && (debug || gdb || diff.engines || chan_in || chan_out)) ||
+      (heatmap && (cores > 1 || debug || gdb || diff.engines)))
+  {
+    usage();
+    exit(2);
+  }
+  timer_start();
+  uint64_t pace = mhz > 0 ? timer_throttle(mhz) : 0;
+  if (diff.engines)
+  {
+    exit(difftest_main(&diff));
+  }
+  if (capture && !capture_open(capture, capture_max))
+  {
+    printf("failed to open capture file: %s\n", capture);
+    exit(1);
+  }
+  if ((chan_in && !chan_open_in(chan_in)) || (chan_out && !chan_open_out(chan_out)))
+  {
+    printf("failed to open the channel: %s\n", chan_in && !chan_out ? chan_in : chan_out);
+    exit(1);
+  }
+  if (heatmap && !heatmap_open(heatmap))
+  {
+    printf("failed to write the heatmap: %s.txt\n", heatmap);
+    exit(1);
+  }
+  if (stats && !stats_open())
+  {
+    printf("failed to create the stats segment\n");
+    exit(1);
+  }
+  if (jit_cache && !debug && !gdb && cores == 1 && !jitcache_open(jit_cache, jit_cache_max))
+  {
+    printf("failed to use the JIT cache directory: %s\n", jit_cache);
+    exit(1);
+  }
+  if (!dump_install(dump_file) || (profile && !profile_start(PROFILE_HZ)))
+  {
+    printf("failed to install the profiling signal handlers\n");
+    exit(1);
+  }
+  signal(SIGINT, handle_interrupt);
+  // Nothing waits in the stdio buffer where select() cannot see it. Before
+  // the first read from stdin, as setvbuf() requires.
+  setvbuf(stdin, NULL, _IONBF, 0);
+  disable_input_buffering();
+
+  // Setup
+  reg[R_COND] = FL_ZRO;
+  reg[R_PC] = PC_START;
+
+  if (screen && !capture)
+  {
+    screen_init();
+  }
+  if (gdb)
+  {
+    debug_init(checkpoint_interval);
+    gdbstub_main(gdb);
+    debug_detach();
+  }
+  else if (debug)
+  {
+    debug_init(checkpoint_interval);
+    debug_main();
+  }
+  if (cores > 1 && !smp_start(cores, pace))
+  {
+    printf("failed to start %d cores\n", cores);
+    exit(1);
+  }
+  if (!debug && cores == 1 && !heatmap)
+  {
+    tier_init(predecode_after, jit_after, trace_after, cgen_after, !jit_sync);
+  }
+  uint64_t next_pace = icount + pace;
+  while (running && !debug && !vm_interrupted)
+  {
+    uint64_t limit = icount + VM_SLICE;
+    if (pace && limit > next_pace)
+    {
+      limit = next_pace;
+    }
+    if (heatmap_enabled)
+    {
+      heatmap_run(limit);
+    }
+    else
+    {
+      tier_run(limit);
+    }
+    if (pace && icount >= next_pace)
+    {
+      timer_pace();
+      next_pace = icount + pace;
+    }
+    vm_tick();
+  }
+  if (vm_interrupted)
+  {
+    vm_quit();
+  }
+  smp_join();
+  vm_finish();
   return 0;
 }
@@ -0,0 +1,175 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <stdint.h>
+#include <signal.h>
+#include <stddef.h>
+
+// Memory mapped registers
+enum
+{
+  MR_KBSR = 0xFE00,
+  MR_KBDR = 0xFE02,
+  MR_CORE_ID = 0xFE20,     // This core, from 0
+  MR_CORE_COUNT = 0xFE21,  // Cores running the image
+  MR_ATOMIC_ADDR = 0xFE22, // Target of the atomic operations, per core
+  MR_ATOMIC_SWAP = 0xFE23, // Read: test-and-set, write: exchange
+  MR_ATOMIC_ADD = 0xFE24,  // Write: fetch-and-add, read: the value fetched
+  MR_RXSR = 0xFE30,        // Channel in: bit 15 a word is ready, bit 14 the end
+  MR_RXDR = 0xFE31,
+  MR_TXSR = 0xFE32,        // Channel out: bit 15 there is room
+  MR_TXDR = 0xFE33,
+  MR_CLOCK = 0xFE40,       // Microseconds since start, 4 words from the lowest
+  MR_INSNS = 0xFE44,       // Instructions retired by this core, 4 words
+  MR_SLEEP = 0xFE48,       // Write: sleep until the clock's low 32 bits reach it
+  MR_SLEEP_HI = 0xFE49,    // The deadline's high word, written first
+};
+
+// TRAP Codes
+enum
+{
+  TRAP_GETC = 0x20,
+  TRAP_OUT = 0x21,
+  TRAP_PUTS = 0x22,
+  TRAP_IN = 0x23,
+  TRAP_PUTSP = 0x24,
+  TRAP_HALT = 0x25
+};
+
+// Registers (8 General Purpose (R0-R7), Program Counter (PC) and Condition Flag (COND)
+enum
+{
+  R_R0 = 0,
+  R_R1,
+  R_R2,
+  R_R3,
+  R_R4,
+  R_R5,
+  R_R6,
+  R_R7,
+  R_PC,
+  R_COND,
+  R_COUNT
+};
+
+// Defining memory
+#define MEMORY_MAX (1 << 16)
+extern uint16_t memory[MEMORY_MAX];
+extern _Thread_local uint16_t reg[R_COUNT]; // Per core
+
+// Conditional flags
+enum
+{
+  FL_POS = 1 << 0,
+  FL_ZRO = 1 << 1,
+  FL_NEG = 1 << 2,
+};
+
+// Instruction Set (Opcodes)
+enum
+{
+  OP_BR = 0,
+  OP_ADD,
+  OP_LD,
+  OP_ST,
+  OP_JSR,
+  OP_AND,
+  OP_LDR,
+  OP_STR,
+  OP_RTI,
+  OP_NOT,
+  OP_LDI,
+  OP_STI,
+  OP_JMP,
+  OP_RES,
+  OP_LEA,
+  OP_TRAP,
+};
+
+enum
+{
+  PC_START = 0x3000
+};
+
+// Execution state, per core
+extern _Thread_local int running;     // Cleared by TRAP_HALT
+extern _Thread_local uint64_t icount; // Instructions executed so far, counting the one in progress
+
+// Terminal
+void disable_input_buffering(void);
+void restore_input_buffering(void);
+
+// Helpers
+uint16_t sign_extend(uint16_t x, int bit_count);
+uint16_t swap16(uint16_t x);
+void update_flags(uint16_t r);
+
+// Memory is classified in 256-word pages. Accesses to pages whose class is
+// zero are plain loads and stores, everything else takes the slow path.
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_SHIFT)
+
+enum
+{
+  PAGE_MMIO = 1 << 0,        // Device registers
+  PAGE_TRACK = 1 << 1,       // Debugger saves the page before its first write
+  PAGE_CODE = 1 << 2,        // Holds predecoded instructions
+  PAGE_WATCH_READ = 1 << 3,  // Debugger watches reads
+  PAGE_WATCH_WRITE = 1 << 4, // Debugger watches writes or value changes
+  PAGE_PROFILE = 1 << 5,     // Every access is counted for --heatmap
+};
+
+#define PAGE_READ_SLOW (PAGE_MMIO | PAGE_WATCH_READ | PAGE_PROFILE)
+#define PAGE_WRITE_SLOW (PAGE_MMIO | PAGE_TRACK | PAGE_CODE | PAGE_WATCH_WRITE | PAGE_PROFILE)
+
+extern uint8_t page_class[PAGE_COUNT];
+
+// Memory access
+// With several cores, loads acquire and stores release, so each core sees
+// another's stores in the order they were made, as on the x86 host where
+// both are plain moves. Only the atomic device orders a store before a
+// later load.
+uint16_t mem_read_slow(uint16_t address);
+void mem_write_slow(uint16_t address, uint16_t value);
+
+static inline uint16_t mem_read(uint16_t address)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_READ_SLOW)
+  {
+    return mem_read_slow(address);
+  }
+  return __atomic_load_n(&memory[address], __ATOMIC_ACQUIRE);
+}
+
+static inline void mem_write(uint16_t address, uint16_t value)
+{
+  if (page_class[address >> PAGE_SHIFT] & PAGE_WRITE_SLOW)
+  {
+    mem_write_slow(address, value);
+    return;
+  }
+  __atomic_store_n(&memory[address], value, __ATOMIC_RELEASE);
+}
+
+// Guest console, every keyboard and display access goes through these
+int input_poll(void);
+int input_getc(void);
+void output_putc(char c);
+void output_write(const char *data, size_t n);
+void output_flush(void);
+
+// Execution
+// Instructions run between two calls to vm_tick()
+#define VM_SLICE 65536
+
+void execute(uint16_t instr);
+void step(void);
+void vm_tick(void);
+
+// Set by Ctrl-C outside the debugger. Whatever notices it at a safe point
+// calls vm_quit(), which saves the JIT cache, flushes output and exits.
+extern volatile sig_atomic_t vm_interrupted;
+void vm_quit(void);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdint.h>
+
+#include "lc3.h"
+#include "predecode.h"
+
+struct insn decoded[MEMORY_MAX];
+
+static uint8_t break_at[MEMORY_MAX];
+static const struct predicate *break_condition[MEMORY_MAX];
+static uint64_t run_limit;
+static int break_hit;
+
+static void op_decode(const struct insn *d);
+
+static void op_add_reg(const struct insn *d)
+{
+  reg[d->r0] = reg[d->r1] + reg[d->r2];
+  update_flags(d->r0);
+}
+
+static void op_add_imm(const struct insn *d)
+{
+  reg[d->r0] = reg[d->r1] + d->imm;
+  update_flags(d->r0);
+}
+
+static void op_and_reg(const struct insn *d)
+{
+  reg[d->r0] = reg[d->r1] & reg[d->r2];
+  update_flags(d->r0);
+}
+
+static void op_and_imm(const struct insn *d)
+{
+  reg[d->r0] = reg[d->r1] & d->imm;
+  update_flags(d->r0);
+}
+
+static void op_not(const struct insn *d)
+{
+  reg[d->r0] = ~reg[d->r1];
+  update_flags(d->r0);
+}
+
+static void op_br(const struct insn *d)
+{
+  if (d->r0 & reg[R_COND])
+  {
+    reg[R_PC] = d->imm;
+  }
+}
+
+static void op_jmp(const struct insn *d)
+{
+  reg[R_PC] = reg[d->r1];
+}
+
+static void op_jsr(const struct insn *d)
+{
+  reg[R_R7] = reg[R_PC];
+  reg[R_PC] = d->imm;
+}
+
+static void op_jsrr(const struct insn *d)
+{
+  reg[R_R7] = reg[R_PC];
+  reg[R_PC] = reg[d->r1];
+}
+
+static void op_ld(const struct insn *d)
+{
+  reg[d->r0] = mem_read(d->imm);
+  update_flags(d->r0);
+}
+
+static void op_ldi(const struct insn *d)
+{
+  reg[d->r0] = mem_read(mem_read(d->imm));
+  update_flags(d->r0);
+}
+
+static void op_ldr(const struct insn *d)
+{
+  reg[d->r0] = mem_read(reg[d->r1] + d->imm);
+  update_flags(d->r0);
+}
+
+static void op_lea(const struct insn *d)
+{
+  reg[d->r0] = d->imm;
+  update_flags(d->r0);
+}
+
+static void op_st(const struct insn *d)
+{
+  mem_write(d->imm, reg[d->r0]);
+}
+
+static void op_sti(const struct insn *d)
+{
+  mem_write(mem_read(d->imm), reg[d->r0]);
+}
+
+static void op_str(const struct insn *d)
+{
+  mem_write(reg[d->r1] + d->imm, reg[d->r0]);
+}
+
+// TRAP, RTI and RES are rare enough to share the interpreter's code
+static void op_execute(const struct insn *d)
+{
+  execute(d->instr);
+  if (!running)
+  {
+    run_limit = 0;
+  }
+}
+
+static struct insn decode(uint16_t address, uint16_t instr);
+
+// Un-fetch the instruction and leave the run loop
+static void op_break(const struct insn *d)
+{
+  uint16_t address = d - decoded;
+  const struct predicate *condition = break_condition[address];
+  if (condition && !predicate_eval(condition))
+  {
+    struct insn original = decode(address, d->instr);
+    original.fn(&original);
+    return;
+  }
+  --reg[R_PC];
+  --icount;
+  break_hit = 1;
+  run_limit = 0;
+}
+
+static struct insn decode(uint16_t address, uint16_t instr)
+{
+  struct insn d = {op_execute, instr, 0, 0, 0, 0};
+  uint16_t next = address + 1;
+
+  d.r0 = (instr >> 9) & 0x7;
+  d.r1 = (instr >> 6) & 0x7;
+  d.r2 = instr & 0x7;
+  switch (instr >> 12)
+  {
+  case OP_ADD:
+    d.fn = (instr & 0x20) ? op_add_imm : op_add_reg;
+    d.imm = sign_extend(instr & 0x1F, 5);
+    break;
+  case OP_AND:
+    d.fn = (instr & 0x20) ? op_and_imm : op_and_reg;
+    d.imm = sign_extend(instr & 0x1F, 5);
+    break;
+  case OP_NOT:
+    d.fn = op_not;
+    break;
+  case OP_BR:
+    d.fn = op_br;
+    d.r0 = (instr >> 9) & 0x7;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_JMP:
+    d.fn = op_jmp;
+    break;
+  case OP_JSR:
+    d.fn = (instr & 0x800) ? op_jsr : op_jsrr;
+    d.imm = next + sign_extend(instr & 0x7FF, 11);
+    break;
+  case OP_LD:
+    d.fn = op_ld;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_LDI:
+    d.fn = op_ldi;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_LDR:
+    d.fn = op_ldr;
+    d.imm = sign_extend(instr & 0x3F, 6);
+    break;
+  case OP_LEA:
+    d.fn = op_lea;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_ST:
+    d.fn = op_st;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_STI:
+    d.fn = op_sti;
+    d.imm = next + sign_extend(instr & 0x1FF, 9);
+    break;
+  case OP_STR:
+    d.fn = op_str;
+    d.imm = sign_extend(instr & 0x3F, 6);
+    break;
+  }
+  return d;
+}
+
+static void op_decode(const struct insn *d)
+{
+  uint16_t address = d - decoded;
+  if (page_class[address >> PAGE_SHIFT] & PAGE_MMIO)
+  {
+    // Fetching from a device register may have side effects, never cache it
+    struct insn once = decode(address, mem_read(address));
+    once.fn(&once);
+    return;
+  }
+
+  struct insn *entry = &decoded[address];
+  *entry = decode(address, memory[address]);
+  page_class[address >> PAGE_SHIFT] |= PAGE_CODE;
+  if (break_at[address])
+  {
+    entry->fn = op_break;
+  }
+  entry->fn(entry);
+}
+
+void predecode_init()
+{
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    decoded[a].fn = op_decode;
+  }
+}
+
+void predecode_invalidate(uint16_t address)
+{
+  decoded[address].fn = op_decode;
+}
+
+struct insn predecode_decode(uint16_t address, uint16_t instr)
+{
+  return decode(address, instr);
+}
+
+void predecode_stop()
+{
+  run_limit = icount;
+}
+
+int predecode_run(uint64_t limit)
+{
+  break_hit = 0;
+  run_limit = running ? limit : 0;
+  while (icount < run_limit)
+  {
+    const struct insn *d = &decoded[reg[R_PC]++];
+    ++icount;
+    d->fn(d);
+  }
+  return break_hit;
+}
+
+void predecode_run_block(uint64_t limit)
+{
+  run_limit = running ? limit : 0;
+  while (icount < run_limit)
+  {
+    const struct insn *d = &decoded[reg[R_PC]++];
+    ++icount;
+    d->fn(d);
+    if (insn_ends_block(d->instr))
+    {
+      break;
+    }
+  }
+}
+
+void predecode_step_over()
+{
+  uint16_t address = reg[R_PC]++;
+  struct insn d = decode(address, memory[address]);
+  ++icount;
+  d.fn(&d);
+}
+
+void predecode_set_break(uint16_t address, int enabled, const struct predicate *condition)
+{
+  break_at[address] = enabled;
+  break_condition[address] = enabled ? condition : NULL;
+  decoded[address].fn = op_decode;
+}
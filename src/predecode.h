@@ -0,0 +1,70 @@
+#ifndef PREDECODE_H
+#define PREDECODE_H
+
+#include <stdint.h>
+
+#include "lc3.h"
+#include "predicate.h"
+
+// A decoded instruction. Handlers run with PC already pointing past the
+// instruction and icount already incremented, like execute().
+struct insn;
+typedef void (*insn_fn)(const struct insn *d);
+
+struct insn
+{
+  insn_fn fn;
+  uint16_t instr;
+  uint8_t r0;   // DR, SR or the nzp mask of BR
+  uint8_t r1;   // SR1 or BaseR
+  uint8_t r2;   // SR2
+  uint16_t imm; // Sign extended immediate, or the absolute target of PC-relative forms
+};
+
+// One entry per guest address, decoded lazily on first execution
+extern struct insn decoded[MEMORY_MAX];
+
+// Instructions after which control may continue somewhere other than the
+// next address. BR with an empty nzp mask never branches.
+static inline int insn_ends_block(uint16_t instr)
+{
+  switch (instr >> 12)
+  {
+  case OP_BR:
+    return (instr & 0x0E00) != 0;
+  case OP_JMP:
+  case OP_JSR:
+  case OP_RTI:
+  case OP_RES:
+  case OP_TRAP:
+    return 1;
+  }
+  return 0;
+}
+
+// Decode without touching the cache, for other engines that want the
+// operands in the same form
+struct insn predecode_decode(uint16_t address, uint16_t instr);
+
+void predecode_init(void);
+void predecode_invalidate(uint16_t address);
+
+// Run until icount reaches limit, the guest halts or a breakpoint is reached.
+// Returns 1 when stopped in front of a breakpoint that has not executed yet.
+int predecode_run(uint64_t limit);
+
+// Like predecode_run, but also return after an instruction that ends a block
+void predecode_run_block(uint64_t limit);
+
+// Make predecode_run return once the current instruction completes
+void predecode_stop(void);
+
+// Execute the instruction under a breakpoint without stopping
+void predecode_step_over(void);
+
+// Breakpoints replace the decoded entry with a handler that stops the run
+// loop, so addresses without one cost nothing. A breakpoint with a condition
+// only stops when it holds and otherwise executes the original instruction.
+void predecode_set_break(uint16_t address, int enabled, const struct predicate *condition);
+
+#endif
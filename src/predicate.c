@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "lc3.h"
+#include "predicate.h"
+
+enum
+{
+  P_CONST, // Push arg
+  P_REG,   // Push reg[arg]
+  P_MEM,   // Replace the top with memory[top]
+  P_MEMC,  // Push memory[arg]
+  P_NEG,
+  P_NOT,
+  P_LNOT,
+  P_MUL,
+  P_DIV,
+  P_MOD,
+  P_ADD,
+  P_SUB,
+  P_SHL,
+  P_SHR,
+  P_LT,
+  P_LE,
+  P_GT,
+  P_GE,
+  P_EQ,
+  P_NE,
+  P_AND,
+  P_XOR,
+  P_OR,
+  P_LAND,
+  P_LOR,
+};
+
+struct parser
+{
+  const char *p;
+  struct predicate *out;
+  int depth;
+  int max_depth;
+  char *error;
+  size_t error_size;
+  int failed;
+};
+
+static void fail(struct parser *ps, const char *message)
+{
+  if (!ps->failed)
+  {
+    snprintf(ps->error, ps->error_size, "%s at '%.10s'", message, ps->p);
+    ps->failed = 1;
+  }
+}
+
+static void emit(struct parser *ps, uint8_t op, int32_t arg)
+{
+  struct predicate *out = ps->out;
+  if (out->length == PREDICATE_MAX)
+  {
+    fail(ps, "expression too long");
+    return;
+  }
+  out->code[out->length].op = op;
+  out->code[out->length].arg = arg;
+  ++out->length;
+}
+
+static int32_t apply(uint8_t op, int32_t a, int32_t b)
+{
+  switch (op)
+  {
+  case P_NEG:
+    return (int32_t)(0u - (uint32_t)a);
+  case P_NOT:
+    return ~a;
+  case P_LNOT:
+    return !a;
+  case P_MUL:
+    return (int32_t)((uint32_t)a * (uint32_t)b);
+  // INT32_MIN / -1 traps, and -a is what it wraps to
+  case P_DIV:
+    return b == -1 ? (int32_t)(0u - (uint32_t)a) : b ? a / b : 0;
+  case P_MOD:
+    return b == -1 || !b ? 0 : a % b;
+  case P_ADD:
+    return (int32_t)((uint32_t)a + (uint32_t)b);
+  case P_SUB:
+    return (int32_t)((uint32_t)a - (uint32_t)b);
+  case P_SHL:
+    return (b >= 0 && b < 32) ? (int32_t)((uint32_t)a << b) : 0;
+  case P_SHR:
+    return (b >= 0 && b < 32) ? (int32_t)((uint32_t)a >> b) : 0;
+  case P_LT:
+    return a < b;
+  case P_LE:
+    return a <= b;
+  case P_GT:
+    return a > b;
+  case P_GE:
+    return a >= b;
+  case P_EQ:
+    return a == b;
+  case P_NE:
+    return a != b;
+  case P_AND:
+    return a & b;
+  case P_XOR:
+    return a ^ b;
+  case P_OR:
+    return a | b;
+  case P_LAND:
+    return a && b;
+  case P_LOR:
+    return a || b;
+  }
+  return 0;
+}
+
+static void push(struct parser *ps)
+{
+  if (++ps->depth > ps->max_depth)
+  {
+    ps->max_depth = ps->depth;
+  }
+  if (ps->depth > PREDICATE_STACK)
+  {
+    fail(ps, "expression too deep");
+  }
+}
+
+// Constant operands are folded as the code is emitted
+static void emit_unary(struct parser *ps, uint8_t op)
+{
+  struct predicate *out = ps->out;
+  if (out->length >= 1 && out->code[out->length - 1].op == P_CONST)
+  {
+    out->code[out->length - 1].arg = apply(op, out->code[out->length - 1].arg, 0);
+    return;
+  }
+  emit(ps, op, 0);
+}
+
+static void emit_binary(struct parser *ps, uint8_t op)
+{
+  struct predicate *out = ps->out;
+  --ps->depth;
+  if (out->length >= 2 && out->code[out->length - 1].op == P_CONST && out->code[out->length - 2].op == P_CONST)
+  {
+    out->code[out->length - 2].arg = apply(op, out->code[out->length - 2].arg, out->code[out->length - 1].arg);
+    --out->length;
+    return;
+  }
+  emit(ps, op, 0);
+}
+
+static void skip_space(struct parser *ps)
+{
+  while (isspace((unsigned char)*ps->p))
+  {
+    ++ps->p;
+  }
+}
+
+static int accept(struct parser *ps, const char *token)
+{
+  static const char *pairs[] = {"||", "&&", "==", "!=", "<=", ">=", "<<", ">>"};
+  skip_space(ps);
+  size_t n = strlen(token);
+  if (strncmp(ps->p, token, n))
+  {
+    return 0;
+  }
+  // Keep "<" from matching the start of "<<" or "<=", and so on
+  for (size_t i = 0; n == 1 && i < sizeof(pairs) / sizeof(pairs[0]); ++i)
+  {
+    if (!strncmp(ps->p, pairs[i], 2))
+    {
+      return 0;
+    }
+  }
+  ps->p += n;
+  return 1;
+}
+
+static void parse_expr(struct parser *ps);
+
+static void parse_primary(struct parser *ps)
+{
+  skip_space(ps);
+  const char *p = ps->p;
+
+  if (accept(ps, "("))
+  {
+    parse_expr(ps);
+    if (!accept(ps, ")"))
+    {
+      fail(ps, "expected ')'");
+    }
+    return;
+  }
+  if (!strncasecmp(p, "mem", 3) && !isalnum((unsigned char)p[3]))
+  {
+    ps->p += 3;
+    if (!accept(ps, "["))
+    {
+      fail(ps, "expected '['");
+      return;
+    }
+    parse_expr(ps);
+    if (!accept(ps, "]"))
+    {
+      fail(ps, "expected ']'");
+      return;
+    }
+    struct predicate *out = ps->out;
+    if (out->length >= 1 && out->code[out->length - 1].op == P_CONST)
+    {
+      out->code[out->length - 1].op = P_MEMC;
+      out->code[out->length - 1].arg &= 0xFFFF;
+    }
+    else
+    {
+      emit(ps, P_MEM, 0);
+    }
+    return;
+  }
+  if ((p[0] == 'r' || p[0] == 'R') && p[1] >= '0' && p[1] <= '7' && !isalnum((unsigned char)p[2]))
+  {
+    ps->p += 2;
+    emit(ps, P_REG, R_R0 + (p[1] - '0'));
+    push(ps);
+    return;
+  }
+  if (!strncasecmp(p, "pc", 2) && !isalnum((unsigned char)p[2]))
+  {
+    ps->p += 2;
+    emit(ps, P_REG, R_PC);
+    push(ps);
+    return;
+  }
+  if (!strncasecmp(p, "cond", 4) && !isalnum((unsigned char)p[4]))
+  {
+    ps->p += 4;
+    emit(ps, P_REG, R_COND);
+    push(ps);
+    return;
+  }
+
+  // Numbers: x3000 or 0x3000 in hex, 12 or #12 in decimal
+  char *end;
+  long value;
+  if ((p[0] == 'x' || p[0] == 'X') && isxdigit((unsigned char)p[1]))
+  {
+    value = strtol(p + 1, &end, 16);
+  }
+  else if (p[0] == '#' && isdigit((unsigned char)p[1]))
+  {
+    value = strtol(p + 1, &end, 10);
+  }
+  else if (isdigit((unsigned char)p[0]))
+  {
+    value = strtol(p, &end, 0);
+  }
+  else
+  {
+    fail(ps, "expected a register, mem[...] or a number");
+    return;
+  }
+  ps->p = end;
+  emit(ps, P_CONST, (int32_t)value);
+  push(ps);
+}
+
+static void parse_unary(struct parser *ps)
+{
+  if (accept(ps, "!"))
+  {
+    parse_unary(ps);
+    emit_unary(ps, P_LNOT);
+  }
+  else if (accept(ps, "~"))
+  {
+    parse_unary(ps);
+    emit_unary(ps, P_NOT);
+  }
+  else if (accept(ps, "-"))
+  {
+    parse_unary(ps);
+    emit_unary(ps, P_NEG);
+  }
+  else
+  {
+    parse_primary(ps);
+  }
+}
+
+// Binary operators from the loosest to the tightest binding level
+static const struct
+{
+  const char *token;
+  uint8_t op;
+  int level;
+} operators[] = {
+    {"||", P_LOR, 0}, {"&&", P_LAND, 1}, {"|", P_OR, 2},  {"^", P_XOR, 3}, {"&", P_AND, 4},
+    {"==", P_EQ, 5},  {"!=", P_NE, 5},   {"<=", P_LE, 6}, {">=", P_GE, 6}, {"<<", P_SHL, 7},
+    {">>", P_SHR, 7}, {"<", P_LT, 6},    {">", P_GT, 6},  {"+", P_ADD, 8}, {"-", P_SUB, 8},
+    {"*", P_MUL, 9},  {"/", P_DIV, 9},   {"%", P_MOD, 9},
+};
+
+#define LEVELS 10
+
+static void parse_level(struct parser *ps, int level)
+{
+  if (level == LEVELS)
+  {
+    parse_unary(ps);
+    return;
+  }
+  parse_level(ps, level + 1);
+  while (!ps->failed)
+  {
+    size_t i;
+    for (i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i)
+    {
+      if (operators[i].level == level && accept(ps, operators[i].token))
+      {
+        break;
+      }
+    }
+    if (i == sizeof(operators) / sizeof(operators[0]))
+    {
+      return;
+    }
+    parse_level(ps, level + 1);
+    emit_binary(ps, operators[i].op);
+  }
+}
+
+static void parse_expr(struct parser *ps)
+{
+  parse_level(ps, 0);
+}
+
+int predicate_compile(const char *text, struct predicate *out, char *error, size_t error_size)
+{
+  struct parser ps = {text, out, 0, 0, error, error_size, 0};
+  out->length = 0;
+  parse_expr(&ps);
+  skip_space(&ps);
+  if (!ps.failed && *ps.p)
+  {
+    fail(&ps, "unexpected input");
+  }
+  return !ps.failed;
+}
+
+int predicate_eval(const struct predicate *p)
+{
+  int32_t stack[PREDICATE_STACK];
+  int sp = 0;
+
+  for (int i = 0; i < p->length; ++i)
+  {
+    int32_t arg = p->code[i].arg;
+    switch (p->code[i].op)
+    {
+    case P_CONST:
+      stack[sp++] = arg;
+      break;
+    case P_REG:
+      stack[sp++] = reg[arg];
+      break;
+    case P_MEM:
+      stack[sp - 1] = memory[stack[sp - 1] & 0xFFFF];
+      break;
+    case P_MEMC:
+      stack[sp++] = memory[arg];
+      break;
+    case P_NEG:
+    case P_NOT:
+    case P_LNOT:
+      stack[sp - 1] = apply(p->code[i].op, stack[sp - 1], 0);
+      break;
+    default:
+      --sp;
+      stack[sp - 1] = apply(p->code[i].op, stack[sp - 1], stack[sp]);
+      break;
+    }
+  }
+  return stack[0] != 0;
+}
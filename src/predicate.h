@@ -0,0 +1,29 @@
+#ifndef PREDICATE_H
+#define PREDICATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Breakpoint conditions such as "R0 == x41 && mem[x4000] > 3" are compiled
+// once into a small stack bytecode. Registers and memory words read as
+// unsigned 16-bit values, arithmetic and comparisons are done on 32 bits.
+#define PREDICATE_MAX 64
+#define PREDICATE_STACK 16
+
+struct predicate
+{
+  int length;
+  struct
+  {
+    uint8_t op;
+    int32_t arg;
+  } code[PREDICATE_MAX];
+};
+
+// Returns 0 and describes the problem in error if the expression is invalid
+int predicate_compile(const char *text, struct predicate *out, char *error, size_t error_size);
+
+// Nonzero if the condition holds for the current guest state
+int predicate_eval(const struct predicate *p);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "lc3.h"
+#include "profile.h"
+#include "stats.h"
+#include "tier.h"
+
+// Hottest PCs listed in a dump
+#define TOP_PCS 10
+
+volatile sig_atomic_t dump_requested;
+
+static uint32_t samples[MEMORY_MAX];
+static volatile uint64_t sample_count;
+static int profiling;
+static const char *dump_path;
+
+static void on_sigprof(int signal)
+{
+  (void)signal;
+  int32_t pc = tier_native_pc;
+  ++samples[pc >= 0 ? (uint16_t)pc : reg[R_PC]];
+  ++sample_count;
+}
+
+static void on_sigusr1(int signal)
+{
+  (void)signal;
+  dump_requested = 1;
+}
+
+// SA_RESTART keeps a blocking key read from failing when a signal arrives
+static int install(int signal, void (*handler)(int))
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(signal, &action, NULL) == 0;
+}
+
+int profile_start(int hz)
+{
+  if (!install(SIGPROF, on_sigprof))
+  {
+    return 0;
+  }
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+  {
+    return 0;
+  }
+  profiling = 1;
+  return 1;
+}
+
+int dump_install(const char *path)
+{
+  dump_path = path;
+  return install(SIGUSR1, on_sigusr1);
+}
+
+static void dump_to(FILE *out)
+{
+  static const char *trap_names[] = {"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT", "x26", "x27"};
+  uint16_t cond = reg[R_COND];
+
+  fprintf(out, "lc3 state after %llu instructions\n", (unsigned long long)icount);
+  for (int r = R_R0; r <= R_R7; ++r)
+  {
+    fprintf(out, "R%d=x%04X%s", r - R_R0, reg[r], (r == R_R3 || r == R_R7) ? "\n" : " ");
+  }
+  fprintf(out, "PC=x%04X COND=%c%c%c\n", reg[R_PC], cond & FL_NEG ? 'n' : '-', cond & FL_ZRO ? 'z' : '-',
+          cond & FL_POS ? 'p' : '-');
+
+  fprintf(out, "traps:");
+  for (int t = 0; t < 8; ++t)
+  {
+    if (counters.traps[t])
+    {
+      fprintf(out, " %s=%llu", trap_names[t], (unsigned long long)counters.traps[t]);
+    }
+  }
+  fprintf(out, "\nkbsr polls=%llu bytes out=%llu input wait=%.3fs\n", (unsigned long long)counters.kbsr_polls,
+          (unsigned long long)counters.bytes_out, counters.input_wait_ns / 1e9);
+
+  if (!profiling)
+  {
+    fprintf(out, "no profile, run with --profile for the top PCs\n");
+    return;
+  }
+  uint64_t total = sample_count;
+  fprintf(out, "top PCs of %llu samples:\n", (unsigned long long)total);
+  // A few passes over the histogram beat sorting 64K entries
+  uint32_t ceiling = UINT32_MAX;
+  int ceiling_pc = -1;
+  for (int n = 0; n < TOP_PCS && total; ++n)
+  {
+    int best = -1;
+    for (int pc = 0; pc < MEMORY_MAX; ++pc)
+    {
+      uint32_t count = samples[pc];
+      if (count && (count < ceiling || (count == ceiling && pc > ceiling_pc)) && (best < 0 || count > samples[best]))
+      {
+        best = pc;
+      }
+    }
+    if (best < 0)
+    {
+      break;
+    }
+    fprintf(out, "  x%04X %10u %5.1f%%\n", best, samples[best], 100.0 * samples[best] / total);
+    ceiling = samples[best];
+    ceiling_pc = best;
+  }
+}
+
+void dump_state()
+{
+  FILE *out = dump_path ? fopen(dump_path, "a") : stderr;
+  if (!out)
+  {
+    perror(dump_path);
+    return;
+  }
+  dump_to(out);
+  fprintf(out, "\n");
+  if (out == stderr)
+  {
+    fflush(out);
+  }
+  else
+  {
+    fclose(out);
+  }
+}
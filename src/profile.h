@@ -0,0 +1,24 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <signal.h>
+
+// Sampling rate of --profile
+#define PROFILE_HZ 1000
+
+// Set by SIGUSR1, handled by vm_tick() between run slices and while the
+// guest waits for a key
+extern volatile sig_atomic_t dump_requested;
+
+// Count the guest PC on every SIGPROF tick of CPU time, or the entry of the
+// generated block or trace running. Returns 0 on failure.
+int profile_start(int hz);
+
+// Ask for a state dump on SIGUSR1, written to path or, if NULL, to stderr.
+// Returns 0 on failure.
+int dump_install(const char *path);
+
+// Registers, condition codes, I/O counters and the hottest sampled PCs
+void dump_state(void);
+
+#endif
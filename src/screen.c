@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "screen.h"
+
+// How long output may stay pending before a flush not forced by input or HALT
+#define FRAME_NS 16000000
+
+// Cells pack the character in the low byte and the attributes above it
+#define CELL(ch, attr) ((uint32_t)(uint8_t)(ch) | ((uint32_t)(attr) << 8))
+#define CELL_ATTR(cell) ((cell) >> 8)
+
+// Attributes: 9 bits of foreground and background colour (COLOR_DEFAULT or
+// 0-255) and the flags
+#define COLOR_DEFAULT 256
+#define ATTR(fg, bg, flags) ((uint32_t)(fg) | ((uint32_t)(bg) << 9) | ((uint32_t)(flags) << 18))
+#define ATTR_FG(attr) ((attr) & 0x1FF)
+#define ATTR_BG(attr) (((attr) >> 9) & 0x1FF)
+#define ATTR_FLAGS(attr) ((attr) >> 18)
+#define ATTR_DEFAULT ATTR(COLOR_DEFAULT, COLOR_DEFAULT, 0)
+
+enum
+{
+  A_BOLD = 1 << 0,
+  A_UNDERLINE = 1 << 1,
+  A_BLINK = 1 << 2,
+  A_REVERSE = 1 << 3,
+};
+
+enum
+{
+  S_GROUND,
+  S_ESC,
+  S_CSI,
+};
+
+#define MAX_PARAMS 16
+
+int screen_enabled;
+
+static int rows = 24;
+static int cols = 80;
+
+// What the guest drew and what the terminal shows
+static uint32_t *back;
+static uint32_t *front;
+
+static int cur_row;
+static int cur_col;
+static uint32_t cur_attr = ATTR_DEFAULT;
+static int cursor_visible = 1;
+static int dirty;
+static int scrolled;
+
+// Parser state
+static int state;
+static int params[MAX_PARAMS];
+static int param_count;
+static int private_mode;
+static char raw[64];
+static size_t raw_len;
+
+// Sequences the model does not interpret are passed through at flush time
+static char passthrough[1024];
+static size_t passthrough_len;
+
+// Terminal state as of the last flush
+static int term_row;
+static int term_col;
+static uint32_t term_attr = ATTR_DEFAULT;
+static int term_cursor_visible = 1;
+static struct timespec dirty_since;
+
+static char *out;
+static size_t out_len;
+static size_t out_cap;
+
+static void emit(const char *s, size_t n)
+{
+  if (out_len + n > out_cap)
+  {
+    out_cap = (out_len + n) * 2;
+    out = realloc(out, out_cap);
+    if (!out)
+    {
+      abort();
+    }
+  }
+  memcpy(out + out_len, s, n);
+  out_len += n;
+}
+
+static void emitf(const char *fmt, int a, int b)
+{
+  char text[32];
+  int n = snprintf(text, sizeof(text), fmt, a, b);
+  emit(text, (size_t)n);
+}
+
+void screen_init()
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0)
+  {
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+  }
+  back = malloc(sizeof(*back) * rows * cols);
+  front = malloc(sizeof(*front) * rows * cols);
+  if (!back || !front)
+  {
+    abort();
+  }
+  for (int i = 0; i < rows * cols; ++i)
+  {
+    back[i] = front[i] = CELL(' ', ATTR_DEFAULT);
+  }
+  // Start from a known blank terminal
+  emit("\033[0m\033[H\033[2J", 11);
+  clock_gettime(CLOCK_MONOTONIC, &dirty_since);
+  screen_enabled = 1;
+  dirty = 1;
+}
+
+static void clear_cells(int from, int to)
+{
+  // Erased cells keep the current background, like a real VT
+  uint32_t blank = CELL(' ', ATTR(COLOR_DEFAULT, ATTR_BG(cur_attr), 0));
+  for (int i = from; i < to; ++i)
+  {
+    back[i] = blank;
+  }
+}
+
+static void scroll_up()
+{
+  memmove(back, back + cols, sizeof(*back) * (rows - 1) * cols);
+  clear_cells((rows - 1) * cols, rows * cols);
+  ++scrolled;
+}
+
+static void line_feed()
+{
+  if (++cur_row == rows)
+  {
+    cur_row = rows - 1;
+    scroll_up();
+  }
+}
+
+static void put_char(char c)
+{
+  if (cur_col >= cols)
+  {
+    cur_col = 0;
+    line_feed();
+  }
+  back[cur_row * cols + cur_col] = CELL(c, cur_attr);
+  ++cur_col;
+}
+
+static int param(int i, int fallback)
+{
+  return (i < param_count && params[i] > 0) ? params[i] : fallback;
+}
+
+static int clamp(int v, int lo, int hi)
+{
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void select_graphic_rendition()
+{
+  uint32_t fg = ATTR_FG(cur_attr);
+  uint32_t bg = ATTR_BG(cur_attr);
+  uint32_t flags = ATTR_FLAGS(cur_attr);
+
+  if (param_count == 0)
+  {
+    params[param_count++] = 0;
+  }
+  for (int i = 0; i < param_count; ++i)
+  {
+    int p = params[i];
+    if (p == 0)
+    {
+      fg = bg = COLOR_DEFAULT;
+      flags = 0;
+    }
+    else if (p == 1)
+      flags |= A_BOLD;
+    else if (p == 4)
+      flags |= A_UNDERLINE;
+    else if (p == 5)
+      flags |= A_BLINK;
+    else if (p == 7)
+      flags |= A_REVERSE;
+    else if (p == 22)
+      flags &= ~A_BOLD;
+    else if (p == 24)
+      flags &= ~A_UNDERLINE;
+    else if (p == 25)
+      flags &= ~A_BLINK;
+    else if (p == 27)
+      flags &= ~A_REVERSE;
+    else if (p >= 30 && p <= 37)
+      fg = p - 30;
+    else if (p == 39)
+      fg = COLOR_DEFAULT;
+    else if (p >= 40 && p <= 47)
+      bg = p - 40;
+    else if (p == 49)
+      bg = COLOR_DEFAULT;
+    else if (p >= 90 && p <= 97)
+      fg = p - 90 + 8;
+    else if (p >= 100 && p <= 107)
+      bg = p - 100 + 8;
+    else if ((p == 38 || p == 48) && i + 2 < param_count && params[i + 1] == 5)
+    {
+      if (p == 38)
+        fg = params[i + 2] & 0xFF;
+      else
+        bg = params[i + 2] & 0xFF;
+      i += 2;
+    }
+  }
+  cur_attr = ATTR(fg, bg, flags);
+}
+
+static void control_sequence(char final)
+{
+  int row = cur_row;
+  int col = cur_col;
+
+  if (private_mode)
+  {
+    if (final == 'h' || final == 'l')
+    {
+      for (int i = 0; i < param_count; ++i)
+      {
+        if (params[i] == 25)
+        {
+          cursor_visible = final == 'h';
+          return;
+        }
+      }
+    }
+    // Alternate screens and the like are outside the model
+    if (passthrough_len + raw_len <= sizeof(passthrough))
+    {
+      memcpy(passthrough + passthrough_len, raw, raw_len);
+      passthrough_len += raw_len;
+    }
+    return;
+  }
+
+  switch (final)
+  {
+  case 'H':
+  case 'f':
+    cur_row = clamp(param(0, 1) - 1, 0, rows - 1);
+    cur_col = clamp(param(1, 1) - 1, 0, cols - 1);
+    break;
+  case 'A':
+    cur_row = clamp(row - param(0, 1), 0, rows - 1);
+    break;
+  case 'B':
+    cur_row = clamp(row + param(0, 1), 0, rows - 1);
+    break;
+  case 'C':
+    cur_col = clamp(col + param(0, 1), 0, cols - 1);
+    break;
+  case 'D':
+    cur_col = clamp(col - param(0, 1), 0, cols - 1);
+    break;
+  case 'G':
+    cur_col = clamp(param(0, 1) - 1, 0, cols - 1);
+    break;
+  case 'd':
+    cur_row = clamp(param(0, 1) - 1, 0, rows - 1);
+    break;
+  case 'J':
+  {
+    int at = row * cols + (col < cols ? col : cols - 1);
+    int mode = param_count ? params[0] : 0;
+    if (mode == 0)
+      clear_cells(at, rows * cols);
+    else if (mode == 1)
+      clear_cells(0, at + 1);
+    else
+      clear_cells(0, rows * cols);
+  }
+  break;
+  case 'K':
+  {
+    int start = row * cols;
+    int at = start + (col < cols ? col : cols - 1);
+    int mode = param_count ? params[0] : 0;
+    if (mode == 0)
+      clear_cells(at, start + cols);
+    else if (mode == 1)
+      clear_cells(start, at + 1);
+    else
+      clear_cells(start, start + cols);
+  }
+  break;
+  case 'm':
+    select_graphic_rendition();
+    break;
+  }
+}
+
+void screen_putc(char c)
+{
+  uint8_t u = (uint8_t)c;
+  if (!dirty)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &dirty_since);
+    dirty = 1;
+  }
+
+  switch (state)
+  {
+  case S_GROUND:
+    if (u == 0x1B)
+    {
+      state = S_ESC;
+      raw_len = 0;
+      raw[raw_len++] = c;
+    }
+    else if (u == '\n')
+    {
+      // The tty's output processing turns LF into CR LF
+      cur_col = 0;
+      line_feed();
+    }
+    else if (u == '\r')
+      cur_col = 0;
+    else if (u == '\b')
+      cur_col = cur_col > 0 ? cur_col - 1 : 0;
+    else if (u == '\t')
+      cur_col = clamp((cur_col / 8 + 1) * 8, 0, cols - 1);
+    else if (u == '\a')
+    {
+      if (passthrough_len < sizeof(passthrough))
+        passthrough[passthrough_len++] = c;
+    }
+    else if (u >= 0x20 && u != 0x7F)
+      put_char(c);
+    break;
+  case S_ESC:
+    raw[raw_len++] = c;
+    if (c == '[')
+    {
+      state = S_CSI;
+      param_count = 0;
+      private_mode = 0;
+      memset(params, 0, sizeof(params));
+    }
+    else
+    {
+      if (c == 'c')
+      {
+        // Full reset
+        cur_attr = ATTR_DEFAULT;
+        cur_row = cur_col = 0;
+        clear_cells(0, rows * cols);
+      }
+      state = S_GROUND;
+    }
+    break;
+  case S_CSI:
+    if (raw_len < sizeof(raw))
+    {
+      raw[raw_len++] = c;
+    }
+    if (c >= '0' && c <= '9')
+    {
+      if (param_count == 0)
+        param_count = 1;
+      params[param_count - 1] = params[param_count - 1] * 10 + (c - '0');
+    }
+    else if (c == ';')
+    {
+      if (param_count == 0)
+        param_count = 1;
+      if (param_count < MAX_PARAMS)
+        ++param_count;
+    }
+    else if (c == '?')
+      private_mode = 1;
+    else if (u >= 0x40 && u <= 0x7E)
+    {
+      control_sequence(c);
+      state = S_GROUND;
+    }
+    break;
+  }
+}
+
+static void emit_attr(uint32_t attr)
+{
+  char text[64];
+  int n = snprintf(text, sizeof(text), "\033[0");
+  uint32_t flags = ATTR_FLAGS(attr);
+  uint32_t fg = ATTR_FG(attr);
+  uint32_t bg = ATTR_BG(attr);
+
+  if (flags & A_BOLD)
+    n += snprintf(text + n, sizeof(text) - n, ";1");
+  if (flags & A_UNDERLINE)
+    n += snprintf(text + n, sizeof(text) - n, ";4");
+  if (flags & A_BLINK)
+    n += snprintf(text + n, sizeof(text) - n, ";5");
+  if (flags & A_REVERSE)
+    n += snprintf(text + n, sizeof(text) - n, ";7");
+  if (fg < 8)
+    n += snprintf(text + n, sizeof(text) - n, ";%u", 30 + fg);
+  else if (fg < 16)
+    n += snprintf(text + n, sizeof(text) - n, ";%u", 90 + fg - 8);
+  else if (fg != COLOR_DEFAULT)
+    n += snprintf(text + n, sizeof(text) - n, ";38;5;%u", fg);
+  if (bg < 8)
+    n += snprintf(text + n, sizeof(text) - n, ";%u", 40 + bg);
+  else if (bg < 16)
+    n += snprintf(text + n, sizeof(text) - n, ";%u", 100 + bg - 8);
+  else if (bg != COLOR_DEFAULT)
+    n += snprintf(text + n, sizeof(text) - n, ";48;5;%u", bg);
+  text[n++] = 'm';
+  emit(text, (size_t)n);
+  term_attr = attr;
+}
+
+// term_col < 0 is a cursor position we do not know, only an absolute move
+// finds it again
+static void emit_move(int row, int col)
+{
+  if (term_col < 0)
+    emitf("\033[%d;%dH", row + 1, col + 1);
+  else if (row == term_row && col == term_col)
+  {
+    return;
+  }
+  else if (row == term_row && col > term_col && col - term_col <= 4)
+  {
+    // Reprinting a short unchanged run is cheaper than a cursor sequence
+    int i = row * cols + term_col;
+    int same = 1;
+    for (int k = 0; k < col - term_col; ++k)
+      same &= CELL_ATTR(front[i + k]) == term_attr;
+    if (same)
+    {
+      for (int k = 0; k < col - term_col; ++k)
+      {
+        char c = (char)(front[i + k] & 0xFF);
+        emit(&c, 1);
+      }
+    }
+    else
+      emitf("\033[%dC", col - term_col, 0);
+  }
+  else if (row == term_row && col > term_col)
+    emitf("\033[%dC", col - term_col, 0);
+  else if (col == 0 && row == term_row + 1)
+    emit("\r\n", 2);
+  else
+    emitf("\033[%d;%dH", row + 1, col + 1);
+  term_row = row;
+  term_col = col;
+}
+
+void screen_flush()
+{
+  if (!dirty)
+  {
+    return;
+  }
+  dirty = 0;
+  emit(passthrough, passthrough_len);
+  passthrough_len = 0;
+
+  // Let the terminal scroll itself and shift our idea of it to match
+  if (scrolled)
+  {
+    int n = scrolled < rows ? scrolled : rows;
+    emitf("\033[%d;1H", rows, 0);
+    for (int i = 0; i < n; ++i)
+    {
+      emit("\n", 1);
+    }
+    memmove(front, front + n * cols, sizeof(*front) * (rows - n) * cols);
+    for (int i = (rows - n) * cols; i < rows * cols; ++i)
+    {
+      front[i] = CELL(' ', ATTR(COLOR_DEFAULT, ATTR_BG(term_attr), 0));
+    }
+    term_row = rows - 1;
+    term_col = 0;
+    scrolled = 0;
+  }
+
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int col = 0; col < cols; ++col)
+    {
+      int i = row * cols + col;
+      if (back[i] == front[i])
+      {
+        continue;
+      }
+      emit_move(row, col);
+      if (CELL_ATTR(back[i]) != term_attr)
+      {
+        emit_attr(CELL_ATTR(back[i]));
+      }
+      char c = (char)(back[i] & 0xFF);
+      emit(&c, 1);
+      front[i] = back[i];
+      if (++term_col == cols)
+      {
+        // Where the cursor sits after the last column differs between terminals
+        term_col = -1;
+      }
+    }
+  }
+
+  emit_move(cur_row, cur_col < cols ? cur_col : cols - 1);
+  if (term_attr != cur_attr)
+  {
+    emit_attr(cur_attr);
+  }
+  if (cursor_visible != term_cursor_visible)
+  {
+    emit(cursor_visible ? "\033[?25h" : "\033[?25l", 6);
+    term_cursor_visible = cursor_visible;
+  }
+
+  size_t done = 0;
+  while (done < out_len)
+  {
+    ssize_t n = write(STDOUT_FILENO, out + done, out_len - done);
+    if (n <= 0)
+    {
+      break;
+    }
+    done += (size_t)n;
+  }
+  out_len = 0;
+}
+
+void screen_flush_due()
+{
+  if (!dirty)
+  {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsed = (int64_t)(now.tv_sec - dirty_since.tv_sec) * 1000000000 + (now.tv_nsec - dirty_since.tv_nsec);
+  if (elapsed >= FRAME_NS)
+  {
+    screen_flush();
+  }
+}
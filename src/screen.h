@@ -0,0 +1,19 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+// Optional output stage that runs the guest's VT100/ANSI stream through a
+// virtual screen and, at flush time, only sends the cells that changed since
+// the last flush. Guests that clear and redraw the whole screen per frame
+// then cost a few bytes and one write per frame.
+extern int screen_enabled;
+
+void screen_init(void);
+void screen_putc(char c);
+
+// Send pending changes. screen_flush_due() only does so when the last flush
+// has been pending for longer than a frame, so a burst of TRAPs becomes a single update.
+// It is called on TRAPs, keyboard polls and between run slices.
+void screen_flush(void);
+void screen_flush_due(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "lc3.h"
+#include "smp.h"
+#include "timer.h"
+
+int smp_cores = 1;
+_Thread_local uint16_t core_id;
+
+// Per core device state
+static _Thread_local uint16_t atomic_addr;
+static _Thread_local uint16_t fetched; // By the last MR_ATOMIC_ADD write
+
+static pthread_t threads[SMP_CORES_MAX];
+static uint64_t paced; // Instructions between calls to timer_pace(), 0 flat out
+static pthread_mutex_t console = PTHREAD_MUTEX_INITIALIZER;
+
+static void *core_main(void *arg)
+{
+  core_id = (uint16_t)(uintptr_t)arg;
+  reg[R_COND] = FL_ZRO;
+  reg[R_PC] = PC_START;
+  while (running && !paced)
+  {
+    step();
+  }
+  while (running)
+  {
+    for (uint64_t limit = icount + paced; running && icount < limit;)
+    {
+      step();
+    }
+    timer_pace();
+  }
+  return NULL;
+}
+
+int smp_start(int cores, uint64_t pace)
+{
+  paced = pace;
+  // Signals are for core 0
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int started = 1;
+  smp_cores = cores;
+  for (int core = 1; core < cores && started; ++core)
+  {
+    started = pthread_create(&threads[core], NULL, core_main, (void *)(uintptr_t)core) == 0;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started;
+}
+
+void smp_join()
+{
+  for (int core = 1; core < smp_cores; ++core)
+  {
+    pthread_join(threads[core], NULL);
+  }
+}
+
+void smp_lock()
+{
+  if (smp_cores > 1)
+  {
+    pthread_mutex_lock(&console);
+  }
+}
+
+void smp_unlock()
+{
+  if (smp_cores > 1)
+  {
+    pthread_mutex_unlock(&console);
+  }
+}
+
+// Exchange or add at the target. Pages the debugger or the tiers watch only
+// exist with a single core, where the store has to go through their path.
+static uint16_t update(int add, uint16_t value)
+{
+  uint16_t *word = &memory[atomic_addr];
+  uint8_t cls = page_class[atomic_addr >> PAGE_SHIFT];
+  if ((cls & PAGE_WRITE_SLOW) && !(cls & PAGE_MMIO))
+  {
+    uint16_t old = *word;
+    mem_write_slow(atomic_addr, add ? old + value : value);
+    return old;
+  }
+  if (add)
+  {
+    return __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+  }
+  return __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+}
+
+uint16_t smp_read(uint16_t address)
+{
+  switch (address)
+  {
+  case MR_CORE_ID:
+    return core_id;
+  case MR_CORE_COUNT:
+    return (uint16_t)smp_cores;
+  case MR_ATOMIC_ADDR:
+    return atomic_addr;
+  case MR_ATOMIC_SWAP:
+    return update(0, 1);
+  case MR_ATOMIC_ADD:
+    return fetched;
+  }
+  return 0;
+}
+
+void smp_write(uint16_t address, uint16_t value)
+{
+  switch (address)
+  {
+  case MR_ATOMIC_ADDR:
+    atomic_addr = value;
+    break;
+  case MR_ATOMIC_SWAP:
+    update(0, value);
+    break;
+  case MR_ATOMIC_ADD:
+    fetched = update(1, value);
+    break;
+  }
+}
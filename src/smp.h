@@ -0,0 +1,35 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+// Most guest cores
+#define SMP_CORES_MAX 64
+
+// Cores sharing memory, 1 unless --smp
+extern int smp_cores;
+
+// This thread's core, 0 on the main thread
+extern _Thread_local uint16_t core_id;
+
+// Start cores 1 to cores - 1, each on a host thread of its own with its own
+// registers and entering the image at PC_START like core 0, which stays on
+// the calling thread. They run in the interpreter until they halt, calling
+// timer_pace() every pace instructions unless it is 0. Returns 0 if a thread
+// cannot be created.
+int smp_start(int cores, uint64_t pace);
+
+// Wait for every core but the caller's to halt
+void smp_join(void);
+
+// The core and atomic device registers, MR_CORE_ID to MR_ATOMIC_ADD. Each
+// atomic operation is sequentially consistent with all others and with the
+// loads and stores around it.
+uint16_t smp_read(uint16_t address);
+void smp_write(uint16_t address, uint16_t value);
+
+// Held by a core while it uses the console or keyboard
+void smp_lock(void);
+void smp_unlock(void);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+#include "stats.h"
+#include "smp.h"
+
+struct vm_counters counters;
+int stats_enabled;
+
+static struct stats_segment *segment;
+static char name[32];
+
+// Start of the current rate window
+static uint64_t window_ns;
+static uint64_t window_icount;
+static uint64_t ips;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_close()
+{
+  shm_unlink(name);
+}
+
+int stats_open()
+{
+  snprintf(name, sizeof(name), STATS_PREFIX "%d", (int)getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  if (ftruncate(fd, sizeof(*segment)) != 0)
+  {
+    close(fd);
+    shm_unlink(name);
+    return 0;
+  }
+  segment = mmap(NULL, sizeof(*segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED)
+  {
+    shm_unlink(name);
+    return 0;
+  }
+  segment->pid = (int32_t)getpid();
+  segment->version = STATS_VERSION;
+  __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  atexit(stats_close);
+
+  window_ns = now_ns();
+  window_icount = icount;
+  stats_enabled = 1;
+  stats_publish(STATS_RUNNING);
+  return 1;
+}
+
+void stats_publish(uint32_t state)
+{
+  // The segment has a single writer, so the other cores' sleeps and key
+  // waits go unreported rather than racing core 0 on seq
+  if (core_id != 0)
+  {
+    return;
+  }
+  uint64_t now = now_ns();
+  if (now - window_ns >= 1000000000)
+  {
+    ips = (icount - window_icount) * 1000000000 / (now - window_ns);
+    window_ns = now;
+    window_icount = icount;
+  }
+
+  uint32_t seq = segment->seq;
+  __atomic_store_n(&segment->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  segment->state = state;
+  segment->published_ns = now;
+  segment->icount = icount;
+  segment->ips = ips;
+  segment->counters = counters;
+  __atomic_store_n(&segment->seq, seq + 2, __ATOMIC_RELEASE);
+}
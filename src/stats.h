@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Counters kept by the VM. Everything here is bumped on paths that already
+// leave the execute loop (traps, device reads, console I/O), so keeping
+// them costs nothing per instruction.
+struct vm_counters
+{
+  uint64_t traps[8]; // By vector, x20 GETC to x27
+  uint64_t kbsr_polls;
+  uint64_t bytes_out;
+  uint64_t input_wait_ns; // Time spent blocked reading a key
+};
+
+extern struct vm_counters counters;
+
+// Layout of the /dev/shm/lc3-PID segment read by lc3-top. The writer makes
+// seq odd while it updates the fields and even again when done; readers
+// retry until they see the same even seq before and after their copy.
+#define STATS_PREFIX "/lc3-"
+#define STATS_MAGIC 0x5354334Cu // "L3TS"
+#define STATS_VERSION 1
+
+enum
+{
+  STATS_RUNNING = 0,
+  STATS_BLOCKED, // Waiting for a key
+  STATS_HALTED,
+  STATS_SLEEPING, // On the guest's sleep register
+};
+
+struct stats_segment
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  int32_t pid;
+  uint32_t state;
+  uint32_t reserved;
+  uint64_t published_ns; // CLOCK_MONOTONIC
+  uint64_t icount;
+  uint64_t ips; // Instructions per second over the last full second
+  struct vm_counters counters;
+};
+
+extern int stats_enabled;
+
+// Create the segment for this process; it is unlinked again at exit.
+// Returns 0 on failure.
+int stats_open(void);
+
+// Copy the counters into the segment. Called between run slices and
+// around blocking input. Only core 0 publishes, other cores return at once.
+void stats_publish(uint32_t state);
+
+#endif
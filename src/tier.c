@@ -0,0 +1,629 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "lc3.h"
+#include "jit.h"
+#include "jitcache.h"
+#include "cgen.h"
+#include "predecode.h"
+#include "tier.h"
+
+// Blocks waiting for the compiler thread
+#define QUEUE_SIZE 256
+
+enum
+{
+  BLOCK_NO_JIT = 1 << 0, // Starts with an instruction the JIT leaves alone
+  BLOCK_QUEUED = 1 << 1, // Handed to the compiler thread
+  BLOCK_TRACE = 1 << 2,  // native is a trace starting here
+  BLOCK_NO_TRACE = 1 << 3,
+  BLOCK_NO_CGEN = 1 << 4, // Its region failed to build through C
+};
+
+// A compiled trace and the path it was compiled from, or a region built
+// through C and the addresses it covers
+struct trace
+{
+  struct trace *next;
+  uint16_t head;
+  uint16_t count;
+  int cgen; // Not in the arena, so it outlives jit_reset()
+  uint16_t path[];
+};
+
+struct block
+{
+  jit_fn native;
+  uint32_t entries;
+  uint16_t length; // Most instructions the native code runs
+  uint8_t flags;
+  uint32_t loops; // Times control came back here from a later address
+
+  // Filled in by the compiler thread. result is stored last with release
+  // ordering and becomes nonzero (JIT_OK + 1 and so on) when it is done.
+  uint8_t result;
+  struct jit_code compiled;
+  uint32_t queued_at; // write_seq when it was queued
+};
+
+volatile sig_atomic_t tier_native_pc = -1;
+
+static struct block blocks[MEMORY_MAX];
+
+// Addresses inside some compiled block, so most writes to code pages only
+// cost a lookup here
+static uint8_t covered[MEMORY_MAX];
+
+// Writes to code pages are numbered, so a compile that raced with the guest
+// rewriting its code is recognised and thrown away
+static uint32_t write_seq;
+static uint32_t last_write[MEMORY_MAX];
+
+static uint32_t predecode_after;
+static uint32_t jit_after;
+static uint32_t trace_after;
+static uint32_t cgen_after;
+static int cgen_busy; // A region is being built
+static int background;
+
+static struct trace *traces;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static uint16_t queue[QUEUE_SIZE];
+static unsigned queue_head;
+static unsigned queue_tail;
+static int arena_full; // The compiler waits until the run loop resets the arena
+static int compiling;
+static int trace_full; // A trace did not fit, reset once the compiler is idle
+
+static void *compiler_main(void *unused)
+{
+  (void)unused;
+  pthread_mutex_lock(&lock);
+  for (;;)
+  {
+    while (queue_head == queue_tail || arena_full)
+    {
+      pthread_cond_wait(&wake, &lock);
+    }
+    struct block *b = &blocks[queue[queue_tail++ % QUEUE_SIZE]];
+    uint16_t address = b - blocks;
+    compiling = 1;
+    pthread_mutex_unlock(&lock);
+
+    int result = jit_compile(address, &b->compiled);
+    __atomic_store_n(&b->result, (uint8_t)(result + 1), __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&lock);
+    compiling = 0;
+    if (result == JIT_FULL)
+    {
+      __atomic_store_n(&arena_full, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+void tier_init(uint32_t predecode, uint32_t jit, uint32_t trace, uint32_t cgen, int compile_thread)
+{
+  predecode_after = predecode;
+  jit_after = jit && jit_init() ? jit : 0;
+  trace_after = jit_after ? trace : 0;
+  cgen_after = trace_after && cgen && cgen_init(compile_thread) ? cgen : 0;
+  predecode_init();
+
+  if (jit_after && compile_thread)
+  {
+    // Signals are for the VM thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    background = pthread_create(&thread, NULL, compiler_main, NULL) == 0;
+    if (background)
+    {
+      pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+}
+
+static void mark_code(uint16_t address)
+{
+  page_class[address >> PAGE_SHIFT] |= PAGE_CODE;
+  page_class[(uint16_t)(address + JIT_BLOCK_MAX - 1) >> PAGE_SHIFT] |= PAGE_CODE;
+}
+
+static void unqueue(struct block *b)
+{
+  b->flags &= ~BLOCK_QUEUED;
+  b->result = 0;
+}
+
+static int written_since(uint16_t address, uint16_t length, uint32_t seq)
+{
+  for (uint16_t i = 0; i < length; ++i)
+  {
+    if ((int32_t)(last_write[(uint16_t)(address + i)] - seq) > 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void install(struct block *b, struct jit_code *code)
+{
+  uint16_t address = b - blocks;
+  for (uint16_t i = 0; i < code->length; ++i)
+  {
+    covered[(uint16_t)(address + i)] = 1;
+  }
+  b->length = code->length;
+  b->native = code->fn;
+  jit_link(address, code->fn, code->length);
+  if (jitcache_enabled && code->relocs)
+  {
+    jitcache_add(address, code);
+  }
+}
+
+static void drop_trace(struct trace *t)
+{
+  struct trace **link = &traces;
+  while (*link != t)
+  {
+    link = &(*link)->next;
+  }
+  *link = t->next;
+  struct block *b = &blocks[t->head];
+  jit_unlink(t->head);
+  b->native = NULL;
+  b->entries = 0;
+  b->loops = 0;
+  b->flags &= ~BLOCK_TRACE;
+  free(t);
+}
+
+static void drop_all()
+{
+  for (struct trace *t = traces, *next; t; t = next)
+  {
+    next = t->next;
+    if (!t->cgen)
+    {
+      drop_trace(t);
+    }
+  }
+  for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+  {
+    struct block *b = &blocks[a];
+    if (!(b->flags & BLOCK_TRACE))
+    {
+      b->native = NULL; // Only regions built through C are left
+    }
+    // Finished compiles point into the old arena, queued ones still run
+    if ((b->flags & BLOCK_QUEUED) && b->result)
+    {
+      free(b->compiled.relocs);
+      unqueue(b);
+    }
+  }
+  memset(covered, 0, sizeof(covered));
+  for (struct trace *t = traces; t; t = t->next)
+  {
+    for (uint16_t i = 0; i < t->count; ++i)
+    {
+      covered[t->path[i]] = 1;
+    }
+  }
+  jit_reset();
+}
+
+static void compile(uint16_t address)
+{
+  struct block *b = &blocks[address];
+  struct jit_code code;
+  mark_code(address);
+  int result = jit_compile(address, &code);
+  if (result == JIT_FULL)
+  {
+    drop_all();
+    result = jit_compile(address, &code);
+  }
+  if (result == JIT_OK)
+  {
+    install(b, &code);
+    free(code.relocs);
+  }
+  else
+  {
+    b->flags |= BLOCK_NO_JIT;
+  }
+}
+
+// Take a block compiled by an earlier run, so it need not get hot again
+static void load_cached(uint16_t address)
+{
+  struct jit_code code;
+  int result = jitcache_load(address, &code);
+  if (result == JIT_FULL && !background)
+  {
+    drop_all();
+    result = jitcache_load(address, &code);
+  }
+  if (result == JIT_OK)
+  {
+    mark_code(address);
+    install(&blocks[address], &code);
+  }
+}
+
+static void enqueue(uint16_t address)
+{
+  struct block *b = &blocks[address];
+  mark_code(address);
+  pthread_mutex_lock(&lock);
+  if (queue_head - queue_tail < QUEUE_SIZE)
+  {
+    queue[queue_head++ % QUEUE_SIZE] = address;
+    b->flags |= BLOCK_QUEUED;
+    b->queued_at = write_seq;
+    pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Pick up what the compiler thread made of a queued block
+static void collect(struct block *b)
+{
+  int result = b->result - 1;
+  unqueue(b);
+  if (result == JIT_OK && (b->flags & BLOCK_TRACE))
+  {
+    // A trace took over the address while the block was compiled
+    free(b->compiled.relocs);
+  }
+  else if (result == JIT_OK)
+  {
+    if (!written_since(b - blocks, b->compiled.length, b->queued_at))
+    {
+      install(b, &b->compiled);
+    }
+    else
+    {
+      b->entries = 0;
+    }
+    free(b->compiled.relocs);
+  }
+  else if (result == JIT_EMPTY)
+  {
+    b->flags |= BLOCK_NO_JIT;
+  }
+}
+
+void tier_invalidate(uint16_t address)
+{
+  last_write[address] = ++write_seq;
+  if (!covered[address])
+  {
+    return;
+  }
+  covered[address] = 0;
+  for (uint16_t back = 0; back < JIT_BLOCK_MAX; ++back)
+  {
+    struct block *b = &blocks[(uint16_t)(address - back)];
+    if (b->native && b->length > back && !(b->flags & BLOCK_TRACE))
+    {
+      // Self-modifying code starts over in the interpreter
+      jit_unlink(b - blocks);
+      b->native = NULL;
+      b->entries = 0;
+      jit_dropped = 1;
+    }
+  }
+  for (struct trace *t = traces, *next; t; t = next)
+  {
+    next = t->next;
+    for (uint16_t i = 0; i < t->count; ++i)
+    {
+      if (t->path[i] == address)
+      {
+        drop_trace(t);
+        jit_dropped = 1;
+        break;
+      }
+    }
+  }
+}
+
+static void interpret_block(uint64_t limit)
+{
+  while (running && icount < limit)
+  {
+    uint16_t instr = mem_read(reg[R_PC]++);
+    ++icount;
+    execute(instr);
+    if (insn_ends_block(instr))
+    {
+      return;
+    }
+  }
+}
+
+static void install_trace(const uint16_t *path, uint16_t count, struct jit_code *code)
+{
+  struct trace *t = malloc(sizeof(*t) + sizeof(t->path[0]) * (count + 1));
+  if (!t)
+  {
+    return;
+  }
+  t->head = path[0];
+  t->count = count;
+  t->cgen = 0;
+  memcpy(t->path, path, sizeof(t->path[0]) * (count + 1));
+  t->next = traces;
+  traces = t;
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    covered[path[i]] = 1;
+  }
+  struct block *b = &blocks[t->head];
+  b->native = code->fn;
+  b->length = code->length;
+  b->flags |= BLOCK_TRACE;
+  b->entries = 0; // Now counts entries into the trace
+  jit_link(t->head, code->fn, code->length);
+}
+
+// Translate the region around a hot trace to C, to be built in the background
+static void request_cgen(uint16_t head)
+{
+  static uint16_t path[CGEN_REGION_MAX];
+  uint16_t count = cgen_region(head, path);
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    // Stores into the region from now on show up in last_write
+    page_class[path[i] >> PAGE_SHIFT] |= PAGE_CODE;
+  }
+  cgen_busy = cgen_request(head, path, count, write_seq);
+  if (!cgen_busy)
+  {
+    blocks[head].flags |= BLOCK_NO_CGEN;
+  }
+}
+
+// Replace the trace at the head of a built region with it, unless the guest
+// rewrote some of the region while it was built
+static void install_cgen(struct cgen_region *r)
+{
+  struct block *b = &blocks[r->head];
+  int stale = !r->fn;
+  for (uint16_t i = 0; i < r->count && !stale; ++i)
+  {
+    stale = written_since(r->path[i], 1, r->tag);
+  }
+  struct trace *t = stale ? NULL : malloc(sizeof(*t) + sizeof(t->path[0]) * r->count);
+  if (!t)
+  {
+    if (!r->fn)
+    {
+      b->flags |= BLOCK_NO_CGEN;
+    }
+    b->entries = 0;
+    free(r->path);
+    return;
+  }
+  for (struct trace *old = traces; old; old = old->next)
+  {
+    if (old->head == r->head)
+    {
+      drop_trace(old);
+      break;
+    }
+  }
+  t->head = r->head;
+  t->count = r->count;
+  t->cgen = 1;
+  memcpy(t->path, r->path, sizeof(t->path[0]) * r->count);
+  free(r->path);
+  t->next = traces;
+  traces = t;
+  for (uint16_t i = 0; i < t->count; ++i)
+  {
+    covered[t->path[i]] = 1;
+  }
+  // Not linked, other generated code returns to tier_run() to enter it
+  b->native = r->fn;
+  b->length = r->length;
+  b->flags |= BLOCK_TRACE | BLOCK_NO_CGEN;
+}
+
+// Run one pass from a loop header instruction by instruction, noting the path
+// taken, and compile it as a trace. The path stops when it gets back to head,
+// at instructions the JIT leaves to execute() and at JIT_TRACE_MAX.
+static void record_trace(uint16_t head, uint64_t limit)
+{
+  static uint16_t path[JIT_TRACE_MAX + 1];
+  struct block *h = &blocks[head];
+  uint32_t seq = write_seq;
+  uint16_t n = 0;
+  while (running && icount < limit && n < JIT_TRACE_MAX)
+  {
+    uint16_t pc = reg[R_PC];
+    uint16_t op = memory[pc] >> 12;
+    if ((n && pc == head) || (page_class[pc >> PAGE_SHIFT] & PAGE_MMIO) || op == OP_TRAP || op == OP_RTI ||
+        op == OP_RES)
+    {
+      break;
+    }
+    // Stores into the path while it is recorded show up in last_write
+    page_class[pc >> PAGE_SHIFT] |= PAGE_CODE;
+    path[n++] = pc;
+    step();
+  }
+  path[n] = reg[R_PC];
+  if (n == 0)
+  {
+    h->flags |= BLOCK_NO_TRACE;
+    return;
+  }
+  if (path[n] != head && (!running || icount >= limit))
+  {
+    return; // Cut short, try again another time
+  }
+  for (uint16_t i = 0; i < n; ++i)
+  {
+    if (written_since(path[i], 1, seq))
+    {
+      return;
+    }
+  }
+
+  struct jit_code code;
+  int result = jit_compile_trace(path, n, &code);
+  if (result == JIT_FULL)
+  {
+    if (background)
+    {
+      __atomic_store_n(&trace_full, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    drop_all();
+    result = jit_compile_trace(path, n, &code);
+  }
+  if (result == JIT_OK)
+  {
+    install_trace(path, n, &code);
+    free(code.relocs);
+  }
+  else
+  {
+    h->flags |= BLOCK_NO_TRACE;
+  }
+}
+
+// Control came back to head from the block that started at or after it,
+// so head is the target of a backward branch: a loop header
+static void loop_back(uint16_t head, uint64_t limit)
+{
+  struct block *h = &blocks[head];
+  if (!(h->flags & (BLOCK_TRACE | BLOCK_NO_TRACE)) && ++h->loops >= trace_after)
+  {
+    h->loops = 0;
+    record_trace(head, limit);
+  }
+}
+
+void tier_run(uint64_t limit)
+{
+  if (!predecode_after && !jit_after)
+  {
+    while (running && icount < limit)
+    {
+      step();
+    }
+    return;
+  }
+
+  if (background && (__atomic_load_n(&arena_full, __ATOMIC_RELAXED) || __atomic_load_n(&trace_full, __ATOMIC_RELAXED)))
+  {
+    // Only while the compiler thread is parked, so no code is being written
+    pthread_mutex_lock(&lock);
+    if (arena_full || !compiling)
+    {
+      drop_all();
+      arena_full = 0;
+      trace_full = 0;
+      pthread_cond_signal(&wake);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  struct cgen_region built;
+  if (cgen_busy && cgen_collect(&built))
+  {
+    cgen_busy = 0;
+    install_cgen(&built);
+  }
+
+  int32_t from = -1; // Start of the block run last
+  while (running && icount < limit)
+  {
+    if (trace_after && reg[R_PC] <= from)
+    {
+      loop_back(reg[R_PC], limit);
+      from = -1;
+      continue;
+    }
+    from = reg[R_PC];
+    struct block *b = &blocks[reg[R_PC]];
+    if (b->native)
+    {
+      // Only enter when the whole block fits, so runs stop exactly at limit
+      if (limit - icount >= b->length)
+      {
+        if (cgen_after && !cgen_busy && (b->flags & BLOCK_TRACE) && !(b->flags & BLOCK_NO_CGEN) &&
+            ++b->entries >= cgen_after)
+        {
+          request_cgen(reg[R_PC]);
+        }
+        tier_native_pc = reg[R_PC];
+        icount += b->native(reg, limit);
+        tier_native_pc = -1;
+        continue;
+      }
+    }
+    else
+    {
+      if (b->entries < UINT32_MAX)
+      {
+        ++b->entries;
+      }
+      if ((b->flags & BLOCK_QUEUED) && __atomic_load_n(&b->result, __ATOMIC_ACQUIRE))
+      {
+        collect(b);
+        if (b->native)
+        {
+          continue;
+        }
+      }
+      if (jit_after && jitcache_enabled && !(b->flags & BLOCK_QUEUED) && jitcache_has(reg[R_PC]))
+      {
+        load_cached(reg[R_PC]);
+        if (b->native)
+        {
+          continue;
+        }
+      }
+      if (jit_after && b->entries >= jit_after && !(b->flags & (BLOCK_NO_JIT | BLOCK_QUEUED)))
+      {
+        if (background)
+        {
+          enqueue(reg[R_PC]);
+        }
+        else
+        {
+          compile(reg[R_PC]);
+          if (b->native)
+          {
+            continue;
+          }
+        }
+      }
+    }
+
+    if (predecode_after && b->entries >= predecode_after)
+    {
+      predecode_run_block(limit);
+    }
+    else
+    {
+      interpret_block(limit);
+    }
+  }
+}
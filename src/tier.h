@@ -0,0 +1,42 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include <signal.h>
+
+// Block entries before a block moves from the interpreter to the predecoded
+// engine, and from there to generated code. Zero turns a tier off.
+#define TIER_PREDECODE_AFTER 2
+#define TIER_JIT_AFTER 1000
+
+// Backward branches to an address before its loop is recorded as a trace
+#define TIER_TRACE_AFTER 500
+
+// A block starts wherever control lands and runs to the next instruction
+// that can branch. Each one counts its entries and is promoted once it
+// crosses a threshold, so run-once startup code is never compiled.
+// With compile_thread, hot blocks are compiled by a background thread while
+// they keep running in the predecoded engine, so compiling never stalls the
+// guest.
+// Loop headers, the targets of backward branches, get a trace once they are
+// hot: one pass through the loop is recorded, across as many blocks as it
+// takes, and compiled as a single straight line that keeps looping in
+// native code and only leaves where a branch goes another way.
+// Traces entered cgen_after times have the region of guest code around them
+// translated to C and built by the host compiler, in the background with
+// compile_thread, which then replaces the trace. Zero leaves them alone.
+void tier_init(uint32_t predecode_after, uint32_t jit_after, uint32_t trace_after, uint32_t cgen_after,
+               int compile_thread);
+
+// Run until icount reaches limit or the guest halts
+void tier_run(uint64_t limit);
+
+// Entry of the generated block or trace running now, -1 outside generated
+// code. Generated code only writes reg[R_PC] back when it leaves, so this is
+// where a SIGPROF sample lands while it runs.
+extern volatile sig_atomic_t tier_native_pc;
+
+// Drop generated code that covers address, called for writes to code pages
+void tier_invalidate(uint16_t address);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "lc3.h"
+#include "stats.h"
+#include "debugger.h"
+#include "timer.h"
+
+static struct timespec origin;
+
+// Nanoseconds per instruction under --mhz, 0 without it
+static double pace_ns;
+
+// Per core
+static _Thread_local uint64_t pace_origin; // Clock at pace_base, in ns
+static _Thread_local uint64_t pace_base;   // icount when pacing started over
+static _Thread_local uint64_t latched_clock;
+static _Thread_local uint64_t latched_count;
+static _Thread_local uint16_t sleep_hi;
+static _Thread_local uint16_t clock_address; // The word clock_word() reads
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)(ts.tv_sec - origin.tv_sec) * 1000000000 + (uint64_t)(ts.tv_nsec - origin.tv_nsec);
+}
+
+static uint64_t now_us()
+{
+  return now_ns() / 1000;
+}
+
+// Relative to origin
+static void sleep_ns(uint64_t until)
+{
+  struct timespec wake = origin;
+  wake.tv_sec += (time_t)(until / 1000000000);
+  wake.tv_nsec += (long)(until % 1000000000);
+  if (wake.tv_nsec >= 1000000000)
+  {
+    wake.tv_nsec -= 1000000000;
+    ++wake.tv_sec;
+  }
+  // Absolute, so a signal that interrupts the sleep does not stretch it.
+  // After Ctrl-C no sleep holds up the run loop noticing.
+  while (!vm_interrupted && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+  {
+  }
+}
+
+void timer_start()
+{
+  clock_gettime(CLOCK_MONOTONIC, &origin);
+}
+
+static void sleep_until(uint32_t deadline)
+{
+  // History already waited the first time round
+  if (debug_enabled && debug_replaying())
+  {
+    return;
+  }
+  uint64_t now = now_us();
+  int32_t left = (int32_t)(deadline - (uint32_t)now);
+  if (left <= 0)
+  {
+    return;
+  }
+  if (stats_enabled)
+  {
+    stats_publish(STATS_SLEEPING);
+  }
+  sleep_ns((now + (uint64_t)left) * 1000);
+  if (stats_enabled)
+  {
+    stats_publish(STATS_RUNNING);
+  }
+}
+
+static int clock_word()
+{
+  if (clock_address == MR_CLOCK)
+  {
+    latched_clock = now_us();
+  }
+  return (uint16_t)(latched_clock >> 16 * (clock_address - MR_CLOCK));
+}
+
+uint16_t timer_read(uint16_t address)
+{
+  switch (address)
+  {
+  case MR_CLOCK:
+  case MR_CLOCK + 1:
+  case MR_CLOCK + 2:
+  case MR_CLOCK + 3:
+    // Every word read is logged like a key, so replay sees the same time
+    // whichever checkpoint it starts from
+    clock_address = address;
+    return (uint16_t)(debug_enabled ? debug_input(clock_word) : clock_word());
+  case MR_INSNS:
+    // Not counting the load in progress
+    latched_count = icount - 1;
+    return (uint16_t)latched_count;
+  case MR_INSNS + 1:
+  case MR_INSNS + 2:
+  case MR_INSNS + 3:
+    return (uint16_t)(latched_count >> 16 * (address - MR_INSNS));
+  case MR_SLEEP_HI:
+    return sleep_hi;
+  }
+  return 0;
+}
+
+void timer_write(uint16_t address, uint16_t value)
+{
+  if (address == MR_SLEEP)
+  {
+    sleep_until((uint32_t)sleep_hi << 16 | value);
+  }
+  else if (address == MR_SLEEP_HI)
+  {
+    sleep_hi = value;
+  }
+}
+
+uint64_t timer_throttle(double mhz)
+{
+  pace_ns = 1000.0 / mhz;
+  double interval = mhz * 10000;
+  return interval < 1 ? 1 : interval > (double)UINT32_MAX ? UINT32_MAX : (uint64_t)interval;
+}
+
+void timer_pace()
+{
+  uint64_t now = now_ns();
+  uint64_t due = pace_origin + (uint64_t)((double)(icount - pace_base) * pace_ns);
+  // More than 100 ms late
+  if (!pace_origin || now > due + 100000000)
+  {
+    pace_origin = now;
+    pace_base = icount;
+    return;
+  }
+  if (due > now)
+  {
+    sleep_ns(due);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Start the guest clock at zero. Called once before the guest runs.
+void timer_start(void);
+
+// MR_CLOCK to MR_SLEEP_HI. Reading the low word of the clock or of the
+// instruction counter latches the whole 64-bit value for the three words
+// above it, so a multi-word read is consistent. Writing MR_SLEEP_HI stages
+// the high half of a deadline and writing MR_SLEEP the low half parks the
+// core until the low 32 bits of the clock reach it; a deadline more than
+// half the 32-bit range away counts as passed.
+uint16_t timer_read(uint16_t address);
+void timer_write(uint16_t address, uint16_t value);
+
+// Hold every core to mhz million instructions per second. Returns how many
+// instructions a core runs between calls to timer_pace(), about 10 ms worth
+// at any speed, so a fast guest spans several VM_SLICE runs per call.
+uint64_t timer_throttle(double mhz);
+
+// Sleep until the calling core's instructions so far are due. A core that
+// fell behind, say waiting for a key, starts over from now instead of
+// running flat out to catch up.
+void timer_pace(void);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+// A session that has not published for this long while not waiting for a
+// key is reported as stuck
+#define STALE_NS 2000000000ull
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Take a consistent copy of a segment. Returns 0 if it is not a stats segment.
+static int snapshot(const char *name, struct stats_segment *out)
+{
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  struct stats_segment *segment = mmap(NULL, sizeof(*segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED)
+  {
+    return 0;
+  }
+  int ok = 0;
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == STATS_MAGIC && segment->version == STATS_VERSION)
+  {
+    uint32_t before, after;
+    do
+    {
+      before = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+      memcpy(out, segment, sizeof(*out));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&segment->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    ok = 1;
+  }
+  munmap(segment, sizeof(*segment));
+  return ok;
+}
+
+static const char *state_name(const struct stats_segment *s, uint64_t now)
+{
+  if (kill(s->pid, 0) != 0)
+  {
+    return "gone";
+  }
+  if (s->state == STATS_HALTED)
+  {
+    return "halted";
+  }
+  if (s->state == STATS_BLOCKED)
+  {
+    return "input";
+  }
+  if (s->state == STATS_SLEEPING)
+  {
+    return "sleep";
+  }
+  return now - s->published_ns > STALE_NS ? "stuck" : "run";
+}
+
+static void show()
+{
+  DIR *dir = opendir("/dev/shm");
+  if (!dir)
+  {
+    perror("/dev/shm");
+    exit(1);
+  }
+  uint64_t now = now_ns();
+  printf("%8s %-6s %8s %14s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n", "PID", "STATE", "MIPS", "INSNS", "KBSR", "OUT",
+         "WAIT", "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT");
+  struct dirent *entry;
+  while ((entry = readdir(dir)))
+  {
+    if (strncmp(entry->d_name, STATS_PREFIX + 1, strlen(STATS_PREFIX) - 1))
+    {
+      continue;
+    }
+    char name[300];
+    snprintf(name, sizeof(name), "/%s", entry->d_name);
+    struct stats_segment s;
+    if (!snapshot(name, &s))
+    {
+      continue;
+    }
+    const struct vm_counters *c = &s.counters;
+    printf("%8d %-6s %8.2f %14llu %10llu %10llu %7.1fs %8llu %8llu %8llu %8llu %8llu %8llu\n", s.pid,
+           state_name(&s, now), s.ips / 1e6, (unsigned long long)s.icount, (unsigned long long)c->kbsr_polls,
+           (unsigned long long)c->bytes_out, c->input_wait_ns / 1e9, (unsigned long long)c->traps[0],
+           (unsigned long long)c->traps[1], (unsigned long long)c->traps[2], (unsigned long long)c->traps[3],
+           (unsigned long long)c->traps[4], (unsigned long long)c->traps[5]);
+  }
+  closedir(dir);
+}
+
+int main(int argc, const char *argv[])
+{
+  int once = argc > 1 && !strcmp(argv[1], "-1");
+  if (argc > 1 && !once)
+  {
+    printf("lc3-top [-1]\n");
+    printf("  shows the counters of every VM started with --stats, refreshed each second\n");
+    printf("  -1  print the table once and exit\n");
+    return 2;
+  }
+  if (once)
+  {
+    show();
+    return 0;
+  }
+  for (;;)
+  {
+    printf("\033[H\033[2J");
+    show();
+    fflush(stdout);
+    sleep(1);
+  }
+}